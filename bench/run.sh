@@ -0,0 +1,53 @@
+#!/bin/sh
+# Runs each bench/*.lr script RUNS times and writes one line per script:
+#
+#   name runs best_s mean_s units units_per_s peak_rss_kb
+#
+# "units" is the last line a script prints: tokens for lexer.lr, words
+# for strings.lr, calls or list items for the rest. Scripts get a
+# multi-megabyte input file as their argument.
+
+set -e
+
+LERL=${1:-./lerl}
+OUT=${2:-bench_output.txt}
+RUNS=${RUNS:-5}
+DIR=$(dirname "$0")
+TIMEIT=$DIR/timeit
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Input: the interpreter's own lerl sources, doubled until >= 4MB.
+cat "$DIR/../lerl.lrc" "$DIR/../ex.lr" > "$TMP/input.lr"
+while [ "$(wc -c < "$TMP/input.lr")" -lt 4194304 ]; do
+    cat "$TMP/input.lr" "$TMP/input.lr" > "$TMP/input.tmp"
+    mv "$TMP/input.tmp" "$TMP/input.lr"
+done
+
+echo "# name runs best_s mean_s units units_per_s peak_rss_kb" > "$OUT"
+
+for script in "$DIR"/*.lr; do
+    name=$(basename "$script" .lr)
+    : > "$TMP/times"
+
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        if ! "$TIMEIT" "$TMP/times" "$LERL" "$script" "$TMP/input.lr" \
+                > "$TMP/stdout" 2> "$TMP/stderr"; then
+            echo "$name: failed" >&2
+            cat "$TMP/stderr" >&2
+            exit 1
+        fi
+        i=$((i + 1))
+    done
+
+    units=$(tail -n 1 "$TMP/stdout")
+    awk -v name="$name" -v units="$units" '
+        { sum += $1; if(NR == 1 || $1 < best) best = $1;
+          if($2 > rss) rss = $2 }
+        END { printf "%s %d %.6f %.6f %d %.0f %d\n",
+                     name, NR, best, sum / NR, units,
+                     (best > 0 ? units / best : 0), rss }' \
+        "$TMP/times" | tee -a "$OUT"
+done
@@ -0,0 +1,54 @@
+/* Runs a command and appends "<wall seconds> <peak rss kB>" to a file.
+ * Used by run.sh, as there's no portable shell way to get peak RSS. */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) {
+    if(argc < 3) {
+        fprintf(stderr, "usage: %s result-file command [args...]\n", argv[0]);
+        return 2;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        return 2;
+    }
+    if(pid == 0) {
+        execvp(argv[2], argv + 2);
+        perror(argv[2]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return 2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wall = (end.tv_sec - start.tv_sec)
+                  + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    FILE *out = fopen(argv[1], "a");
+    if(out == NULL) {
+        perror(argv[1]);
+        return 2;
+    }
+    fprintf(out, "%.6f %ld\n", wall, usage.ru_maxrss);
+    fclose(out);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
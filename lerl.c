@@ -1,3 +1,6 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -7,10 +10,64 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+
+#include "lerl.h"
 
 typedef unsigned int uint;
 
-bool dbg = false;
+// Runtime state outside of RunEnv and SymTab (cell and string
+// pools, profiler, trace, writers, flags) is thread-local, so each
+// thread can run its own interpreter (see interpret()). Values of
+// one interpreter are only shared with the threads of its pmap
+// pool, which is why refcounts go through refInc() and refDec().
+__thread bool dbg = false;
+
+// Script errors end the script through fail(). Inside a call of
+// the embedding API (see lerl.h) it returns code from there, in
+// the CLI the process exits with it.
+__thread jmp_buf *failJump = NULL;
+__thread int failCode;
+
+__attribute__((noreturn)) void fail (int code) {
+    if(failJump == NULL) exit(code);
+    failCode = code;
+    longjmp(*failJump, 1);
+}
+
+// Count of pmap jobs running in the process. While there are any,
+// refcounts change atomically, as a value may be reachable from
+// several threads; otherwise plain increments are enough.
+uint sharedRefs = 0;
+
+bool refsShared () {
+    return __atomic_load_n(&sharedRefs, __ATOMIC_ACQUIRE) > 0;
+}
+
+void refInc (uint *refs) {
+    if(refsShared()) __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+    else (*refs)++;
+}
+
+// Returns the refs left, so the owner is freed at 0.
+uint refDec (uint *refs) {
+    if(refsShared()) return __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL);
+    return --(*refs);
+}
+
+uint refCount (uint *refs) {
+    if(refsShared()) return __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+    return *refs;
+}
 
 typedef struct String {
     const char    *data;
@@ -57,7 +114,7 @@ typedef struct Source {
     } \
     \
     void free_ ## TYPE ## Array (TYPE ## Array tgt) {\
-        if(--tgt.refs == 0) \
+        if(refDec(&tgt.refs) == 0) \
             free(tgt.data); \
     }
 
@@ -72,7 +129,7 @@ Source load_file (const char *file_name) {
        || (retval.buff = mmap(NULL, details.st_size, PROT_READ,
                               MAP_SHARED, retval.fd, 0)) == MAP_FAILED) {
         fprintf(stderr, "%s: can't open\n", file_name);
-        exit(1);
+        fail(1);
     }
     
     retval.name = file_name;
@@ -87,86 +144,304 @@ void close_source (Source src) {
     close(src.fd);
 }
 
-uint count_symbols (Source src) {
-    uint n = 0;
-    uint mod = 0;
-    for(uint i = 0; i < src.len; i++) {
-        if(src.buff[i] == ' '
-        || src.buff[i] == '\t'
-        || src.buff[i] == '\n') {
-            if(mod == 1)
-                mod = 0;
-        } else {
-            if(mod == 0) {
-                n++;
-                mod = 1;
-            }
+// Streams read a file, pipe or stdin ("-") in chunks, for inputs
+// which can't be mapped or are too big for it. Unread data is
+// buff[start..end); it is moved to the front before the next chunk
+// is read after it, so the buffer only grows for records longer
+// than STREAM_CHUNK. Records point into the buffer and stay valid
+// until the next one is read.
+#define STREAM_CHUNK 65536
+
+typedef struct Stream {
+    String  name;
+    int     fd;
+    char    *buff;
+    size_t  start, end, cap;
+    bool    eof;
+    uint    refs;
+} Stream;
+
+Stream *openStream (String name) {
+    char path[name.len+1];
+    memcpy(path, name.data, name.len);
+    path[name.len] = 0;
+
+    int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "%s: can't open\n", path);
+        fail(1);
+    }
+
+    // Lets the kernel read ahead of us; fails harmlessly on pipes.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    Stream *ans = malloc(sizeof(Stream));
+    *ans = (Stream) {
+        .name = name,
+        .fd = fd,
+        .buff = malloc(2 * STREAM_CHUNK),
+        .start = 0, .end = 0, .cap = 2 * STREAM_CHUNK,
+        .eof = false,
+        .refs = 1
+    };
+    return ans;
+}
+
+void releaseStream (Stream *st) {
+    if(refDec(&st->refs) > 0) return;
+
+    if(st->fd != STDIN_FILENO) close(st->fd);
+    free(st->buff);
+    free(st);
+}
+
+// Reads next chunk after unread data. False at end of input.
+bool streamFill (Stream *st) {
+    if(st->eof) return false;
+
+    if(st->start > 0) {
+        memmove(st->buff, st->buff + st->start, st->end - st->start);
+        st->end -= st->start;
+        st->start = 0;
+    }
+
+    if(st->cap - st->end < STREAM_CHUNK) {
+        st->cap *= 2;
+        st->buff = realloc(st->buff, st->cap);
+        if(st->buff == NULL) {
+            fprintf(stderr, "out of memory\n");
+            fail(1);
+        }
+    }
+
+    ssize_t n;
+    do {
+        n = read(st->fd, st->buff + st->end, st->cap - st->end);
+    } while(n < 0 && errno == EINTR);
+
+    if(n <= 0) {
+        if(n < 0) {
+            fprintf(stderr, "%.*s: %s\n", (int)st->name.len,
+                    st->name.data, strerror(errno));
         }
+        st->eof = true;
+        return false;
     }
 
-    return n;
+    st->end += n;
+    return true;
 }
 
-off_t load_symbols (Source src, StringArray arr, off_t offset) {
-    uint mod = 1;
-    uint symstart = 0;
-    for (uint i = 0; i < src.len; i++) {
-        if(src.buff[i] == ' '
-        || src.buff[i] == '\t'
-        || src.buff[i] == '\n') {
-            if(mod == 1) {
-                mod = 0;
-                arr.data[offset++] = (String) {
-                    .data =  src.buff + symstart,
-                    .len = i - symstart
-                };
-            }
-        } else {
-            if(mod == 0) {
-                symstart = i;
-                mod = 1;
-            }
+// Next record ending with sep (not included), last one may miss
+// it. False when the input is over.
+bool streamRecord (Stream *st, char sep, String *rec) {
+    size_t seen = 0;
+    while(true) {
+        char *from = st->buff + st->start;
+        char *hit = memchr(from + seen, sep, st->end - st->start - seen);
+        if(hit != NULL) {
+            *rec = (String) { .data = from, .len = hit - from };
+            st->start += rec->len + 1;
+            return true;
         }
+
+        seen = st->end - st->start;
+        if(!streamFill(st)) break;
     }
 
-    if(mod == 1) {
-        arr.data[offset++] = (String) {
-            .data = src.buff + symstart,
-            .len = src.len - symstart
-        };
+    if(st->start == st->end) return false;
+
+    *rec = (String) { .data = st->buff + st->start,
+                      .len = st->end - st->start };
+    st->start = st->end;
+    return true;
+}
+
+// Tokens of run_source() are whitespace separated words. They
+// are found lazily, one at a time, straight from the source
+// buffer. Whitespace is classified a block at a time when
+// SSE2/AVX2 is available.
+typedef struct TokenStream {
+    Source  src;
+    size_t  pos;
+} TokenStream;
+
+bool isWhite (char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_BLOCK 32
+
+uint whiteMask (const char *p) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i w = _mm256_or_si256(
+                    _mm256_or_si256(
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return (uint) _mm256_movemask_epi8(w);
+}
+
+uint setMask (const char *p, const char *set, uint n) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i m = _mm256_setzero_si256();
+    for(uint i = 0; i < n; i++)
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(set[i])));
+    return (uint) _mm256_movemask_epi8(m);
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_BLOCK 16
+
+uint whiteMask (const char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i w = _mm_or_si128(
+                    _mm_or_si128(
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    return (uint) _mm_movemask_epi8(w);
+}
+
+uint setMask (const char *p, const char *set, uint n) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i m = _mm_setzero_si128();
+    for(uint i = 0; i < n; i++)
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(set[i])));
+    return (uint) _mm_movemask_epi8(m);
+}
+#endif
+
+// Returns first position from pos, where isWhite() != white.
+size_t scanWhile (const char *buff, size_t pos, size_t len, bool white) {
+    #ifdef SCAN_BLOCK
+    uint full = (SCAN_BLOCK == 32) ? ~0u : (1u << SCAN_BLOCK) - 1;
+    for(; pos + SCAN_BLOCK <= len; pos += SCAN_BLOCK) {
+        uint stop = whiteMask(buff + pos);
+        if(white) stop = ~stop & full;
+        if(stop != 0)
+            return pos + __builtin_ctz(stop);
     }
+    #endif
+
+    while(pos < len && isWhite(buff[pos]) == white) pos++;
+    return pos;
+}
+
+// Returns first position from pos holding one of n bytes of set,
+// or len. A single byte goes to memchr().
+size_t scanSet (const char *buff, size_t pos, size_t len,
+                const char *set, uint n) {
+    if(n == 1) {
+        const char *hit = memchr(buff + pos, set[0], len - pos);
+        return (hit == NULL) ? len : (size_t)(hit - buff);
+    }
+
+    #ifdef SCAN_BLOCK
+    for(; pos + SCAN_BLOCK <= len; pos += SCAN_BLOCK) {
+        uint hit = setMask(buff + pos, set, n);
+        if(hit != 0)
+            return pos + __builtin_ctz(hit);
+    }
+    #endif
+
+    while(pos < len && memchr(set, buff[pos], n) == NULL) pos++;
+    return pos;
+}
+
+bool nextToken (TokenStream *ts, String *token) {
+    const char *buff = ts->src.buff;
+    size_t len = ts->src.len;
+
+    size_t start = scanWhile(buff, ts->pos, len, true);
+    if(start == len) {
+        ts->pos = len;
+        return false;
+    }
+
+    ts->pos = scanWhile(buff, start, len, false);
+    *token = (String) {
+        .data = buff + start,
+        .len = ts->pos - start
+    };
 
-    return offset;
+    return true;
 }
 
 typedef struct Symbol Symbol;
 typedef struct SymbolArray SymbolArray;
 typedef struct List List;
-typedef struct RunEnv RunEnv;
+typedef struct SymTab SymTab;
+typedef struct Locals Locals;
+typedef struct Builder Builder;
+typedef struct Vector Vector;
+typedef struct Deque Deque;
+typedef struct Text Text;
 
 struct Symbol {
     String  word;
-    enum { STRING, INT, CHAR, BUILTIN, FUNCTION, ARRAY, SOURCE, LIST, SYMBOL, BOOLEAN, SCOPE, NOTHING, ANY } type;
+    enum { STRING, INT, CHAR, BUILTIN, FUNCTION, ARRAY, SOURCE, LIST, SYMBOL, BOOLEAN, SCOPE, BUILDER, VECTOR, DEQUE, STREAM, NOTHING, ANY } type;
     union {
         String      string;
         void        (*builtin) (RunEnv *env);
         StringArray array;
         Source      source;
         List        *list;
+        Builder     *builder;
+        Vector      *vector;
+        Deque       *deque;
+        Stream      *stream;
         bool        boolean;
         char        character;
         int         integer;
     } value;
+    Text    *text;      // owns word and string made at runtime, or NULL
 };
 ArrayOf(Symbol)
 
+// Operand stack, top is data[len-1].
+typedef struct Stack {
+    Symbol  *data;
+    size_t  len, cap;
+} Stack;
+
 struct RunEnv {
-    List *stack, *globals, *scopeStack;
+    Stack   stack;
+    List    *scopeStack;
+    SymTab  *globals;
+
+    // Locals of the running fn are locals.data[frameBase...],
+    // laid out by frame (NULL if it has none).
+    Stack   locals;
+    size_t  frameBase;
+    Locals  *frame;
+
+    // Tail calls: tailPos is set while the last token of a body
+    // is evaluated. Instead of nesting eval(), calls made from
+    // there leave their body in tail and eval() continues with it
+    // in the current frame.
+    bool    tailPos, hasTail, tailOwned;
+    Symbol  tail;
+
+    // Quote mode: ( swaps globals and scopes for these, ) swaps
+    // them back once quoteMarks, stack depths where quotes begun,
+    // runs out.
+    SymTab  *quoteGlobals;
+    List    *quoteScopes;
+    List    *quoteMarks;
+
+    // Set while running a pmap body. Its globals are shared with
+    // the pool's other threads, so they are only read, see
+    // mapQuote().
+    bool    inPmap;
 };
 
 StringArray mkStringArray(size_t size, const char **vals) {
     StringArray ans = (StringArray) {
         .len = size,
+        .refs = 1,
         .data = malloc(size * sizeof(String))
     };
 
@@ -180,19 +455,324 @@ StringArray mkStringArray(size_t size, const char **vals) {
     return ans;
 }
 
-void printStringArray(FILE *out, String name, StringArray arr) {
-    fprintf(out, "ARRAY %.*s: ", (int)name.len, name.data);
+// Values are printed through Writers, which collect output in a
+// large buffer and format it by hand, so that printing a value
+// isn't a stdio call with format parsing each time. Buffer goes
+// to the file when full, on flush builtin and at exit; autoflush
+// writers send it after every printed value.
+#define WRITER_BUFF 65536
+
+typedef struct Writer {
+    FILE    *file;
+    bool    autoflush;
+    size_t  len;
+    char    buff[WRITER_BUFF];
+} Writer;
+
+__thread Writer outw, errw;
+
+void flushWriter (Writer *w) {
+    if(w->len > 0) fwrite(w->buff, 1, w->len, w->file);
+    w->len = 0;
+    fflush(w->file);
+}
+
+void flushOutput () {
+    flushWriter(&outw);
+}
+
+void initWriters () {
+    // Terminals get output as it is printed.
+    if(outw.file == NULL)
+        outw = (Writer) { .file = stdout,
+                          .autoflush = isatty(STDOUT_FILENO) };
+    if(errw.file == NULL)
+        errw = (Writer) { .file = stderr, .autoflush = true };
+}
+
+void writeBytes (Writer *w, const char *data, size_t len) {
+    if(w->len + len > WRITER_BUFF) {
+        flushWriter(w);
+        if(len > WRITER_BUFF) {
+            fwrite(data, 1, len, w->file);
+            return;
+        }
+    }
+
+    memcpy(w->buff + w->len, data, len);
+    w->len += len;
+}
+
+void writeChar (Writer *w, char c) {
+    if(w->len == WRITER_BUFF) flushWriter(w);
+    w->buff[w->len++] = c;
+}
+
+void writeStr (Writer *w, String s) {
+    writeBytes(w, s.data, s.len);
+}
+
+#define writeConst(W, STRING) writeBytes(W, STRING, sizeof(STRING)-1)
+
+#define INT_DIGITS 12
+
+// Formats n at the end of digits, returns index of its start.
+uint formatInt (char digits[INT_DIGITS], int n) {
+    uint i = INT_DIGITS;
+    uint u = (n < 0) ? -(uint)n : (uint)n;
+
+    do {
+        digits[--i] = '0' + u % 10;
+        u /= 10;
+    } while(u > 0);
+    if(n < 0) digits[--i] = '-';
+
+    return i;
+}
+
+void writeInt (Writer *w, int n) {
+    char digits[INT_DIGITS];
+    uint i = formatInt(digits, n);
+    writeBytes(w, digits + i, INT_DIGITS - i);
+}
+
+void printStringArray(Writer *out, String name, StringArray arr) {
+    writeConst(out, "ARRAY ");
+    writeStr(out, name);
+    writeConst(out, ": ");
     for(uint i = 0; i < arr.len; i++) {
-        String s = arr.data[i];
-        fprintf(out, "%.*s ", (int)s.len, s.data);
+        writeStr(out, arr.data[i]);
+        writeChar(out, ' ');
+    }
+    writeChar(out, '\n');
+}
+
+// Mutable text for the builder builtins. Buffer grows by doubling,
+// so appends are amortized O(1). >str copies it into a string page.
+struct Builder {
+    char    *data;
+    size_t  len, cap;
+    uint    refs;
+};
+
+Builder *mkBuilder () {
+    Builder *ans = malloc(sizeof(Builder));
+    *ans = (Builder) { .data = NULL, .len = 0, .cap = 0, .refs = 1 };
+    return ans;
+}
+
+void releaseBuilder (Builder *b) {
+    if(refDec(&b->refs) > 0) return;
+
+    free(b->data);
+    free(b);
+}
+
+void builderAppend (Builder *b, const char *data, size_t len) {
+    if(b->len + len > b->cap) {
+        // data may be b's own text (a builder appended to itself),
+        // which realloc moves.
+        bool own = b->data != NULL && (uintptr_t) data >= (uintptr_t) b->data
+                   && (uintptr_t) data < (uintptr_t) (b->data + b->len);
+        size_t off = own ? (size_t) (data - b->data) : 0;
+
+        while(b->len + len > b->cap)
+            b->cap = (b->cap == 0) ? 64 : b->cap * 2;
+
+        b->data = realloc(b->data, b->cap);
+        if(b->data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            fail(1);
+        }
+
+        if(own) data = b->data + off;
+    }
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// VECTOR owns its elements, grows by doubling at the end.
+struct Vector {
+    Symbol  *data;
+    size_t  len, cap;
+    uint    refs;
+};
+
+void releaseVector (Vector *v);
+Symbol refsym (Symbol s);
+
+Vector *mkVector () {
+    Vector *ans = malloc(sizeof(Vector));
+    *ans = (Vector) { .data = NULL, .len = 0, .cap = 0, .refs = 1 };
+    return ans;
+}
+
+void vectorPush (Vector *v, Symbol s) {
+    if(v->len == v->cap) {
+        v->cap = (v->cap == 0) ? 16 : v->cap * 2;
+        v->data = realloc(v->data, v->cap * sizeof(Symbol));
+        if(v->data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            fail(1);
+        }
+    }
+
+    v->data[v->len++] = s;
+}
+
+// DEQUE is a ring buffer, cap is a power of two. Elements are
+// owned like in VECTOR, i-th of them is at (head + i) & (cap - 1).
+struct Deque {
+    Symbol  *data;
+    size_t  head, len, cap;
+    uint    refs;
+};
+
+void releaseDeque (Deque *d);
+
+Deque *mkDeque () {
+    Deque *ans = malloc(sizeof(Deque));
+    *ans = (Deque) { .data = NULL, .head = 0, .len = 0, .cap = 0, .refs = 1 };
+    return ans;
+}
+
+Symbol *dequeAt (Deque *d, size_t i) {
+    return d->data + ((d->head + i) & (d->cap - 1));
+}
+
+void dequeReserve (Deque *d) {
+    if(d->len < d->cap) return;
+
+    size_t cap = (d->cap == 0) ? 16 : d->cap * 2;
+    Symbol *data = malloc(cap * sizeof(Symbol));
+    if(data == NULL) {
+        fprintf(stderr, "out of memory\n");
+        fail(1);
+    }
+
+    for(size_t i = 0; i < d->len; i++)
+        data[i] = *dequeAt(d, i);
+    free(d->data);
+
+    d->data = data;
+    d->cap = cap;
+    d->head = 0;
+}
+
+void dequePushFront (Deque *d, Symbol s) {
+    dequeReserve(d);
+    d->head = (d->head - 1) & (d->cap - 1);
+    d->data[d->head] = s;
+    d->len++;
+}
+
+void dequePushBack (Deque *d, Symbol s) {
+    dequeReserve(d);
+    *dequeAt(d, d->len++) = s;
+}
+
+// Pops expect d not to be empty.
+Symbol dequePopFront (Deque *d) {
+    Symbol ans = d->data[d->head];
+    d->head = (d->head + 1) & (d->cap - 1);
+    d->len--;
+    return ans;
+}
+
+Symbol dequePopBack (Deque *d) {
+    return *dequeAt(d, --d->len);
+}
+
+// Strings made by scripts (>str, line, ...) own their bytes
+// through a Text. Each symbol pointing into it, slices of it
+// included, holds one reference in its text field.
+struct Text {
+    uint    refs;
+    char    data[];
+};
+
+Symbol textSymbol (const char *data, size_t len) {
+    Text *t = malloc(sizeof(Text) + len);
+    if(t == NULL) {
+        fprintf(stderr, "out of memory\n");
+        fail(1);
+    }
+
+    t->refs = 1;
+    memcpy(t->data, data, len);
+    String str = { .data = t->data, .len = len };
+    return (Symbol) {
+                .word = str,
+                .type = STRING,
+                .value.string = str,
+                .text = t };
+}
+
+// STRING of piece, which lies within the string of whole.
+Symbol sliceSymbol (Symbol whole, String piece) {
+    if(whole.text != NULL) refInc(&whole.text->refs);
+    return (Symbol) {
+                .word = piece,
+                .type = STRING,
+                .value.string = piece,
+                .text = whole.text };
+}
+
+void releaseText (Text *t) {
+    if(refDec(&t->refs) == 0) free(t);
+}
+
+// Strings that live as long as the thread's interpreters, like
+// names of loaded files, are kept in pages released all at once
+// by releaseStrings().
+#define STRING_PAGE 65536
+
+typedef struct StringPage {
+    struct StringPage   *next;
+    size_t              used, cap;
+    char                data[];
+} StringPage;
+
+__thread StringPage *stringPages = NULL;
+
+String keepString (const char *data, size_t len) {
+    if(stringPages == NULL || stringPages->used + len > stringPages->cap) {
+        size_t cap = (len > STRING_PAGE) ? len : STRING_PAGE;
+        StringPage *page = malloc(sizeof(StringPage) + cap);
+        if(page == NULL) {
+            fprintf(stderr, "out of memory\n");
+            fail(1);
+        }
+
+        *page = (StringPage) { .next = stringPages, .used = 0, .cap = cap };
+        stringPages = page;
+    }
+
+    char *ans = stringPages->data + stringPages->used;
+    memcpy(ans, data, len);
+    stringPages->used += len;
+
+    return (String) { .data = ans, .len = len };
+}
+
+void releaseStrings () {
+    while(stringPages != NULL) {
+        StringPage *next = stringPages->next;
+        free(stringPages);
+        stringPages = next;
     }
-    fprintf(out, "\n");
 }
 
 void builtin_load(RunEnv *env);
 void builtin_content(RunEnv *env);
+void builtin_flush(RunEnv *env);
 void builtin_cut(RunEnv *env);
+void builtin_split(RunEnv *env);
+void builtin_indexOf(RunEnv *env);
+void builtin_contains(RunEnv *env);
 void builtin_quote(RunEnv *env);
+SymTab *quoteTable(SymTab *globals);
 void builtin_isString(RunEnv *env);
 void builtin_isList(RunEnv *env);
 void builtin_doWhile(RunEnv *env);
@@ -228,35 +808,135 @@ void builtin_in (RunEnv *env);
 void builtin_exit (RunEnv *env);
 void builtin_dbgon (RunEnv *env);
 void builtin_dbgoff (RunEnv *env);
+void builtin_profon (RunEnv *env);
+void builtin_profoff (RunEnv *env);
+void builtin_traceon (RunEnv *env);
+void builtin_traceoff (RunEnv *env);
 void builtin_eval (RunEnv *env);
 void builtin_toInt (RunEnv *env);
 void builtin_toSym (RunEnv *env);
 void builtin_toStr (RunEnv *env);
+void builtin_builder (RunEnv *env);
+void builtin_appendText (RunEnv *env);
+void builtin_toVec (RunEnv *env);
+void builtin_toLst (RunEnv *env);
+void builtin_deque (RunEnv *env);
+void builtin_popLast (RunEnv *env);
+void builtin_stream (RunEnv *env);
+void builtin_line (RunEnv *env);
+void builtin_eachLine (RunEnv *env);
+void builtin_pmap (RunEnv *env);
 void builtin_lst (RunEnv *env);
 void builtin_pop (RunEnv *env);
 void builtin_isEmpty (RunEnv *env);
 void builtin_inject (RunEnv *env);
 void builtin_extract (RunEnv *env);
 void builtin_cons (RunEnv *env);
-void printSymbol (FILE *out, Symbol s);
+void builtin_tokenize (RunEnv *env);
+void printSymbol (Writer *out, Symbol s);
+Symbol specialSym (Symbol s);
+
+typedef struct GlobalSlot GlobalSlot;
+
+// How a cell of a fn body uses local slot of its frame (see
+// linkLocals()): LINK_LOCAL reads it, LINK_NAME pushes the name
+// for assign or extract, LINK_STORE is assign storing into it.
+// LINK_CONST cells hold a quoted name ('x), which linkBody() found
+// to be pushed without its quote rather than looked up.
+typedef enum LinkKind {
+    LINK_NONE, LINK_LOCAL, LINK_NAME, LINK_STORE, LINK_CONST
+} LinkKind;
 
 typedef struct List {
     Symbol      val;
     uint        refs;
+    uint16_t    local;
+    uint8_t     link;
+    GlobalSlot  *bound;
+    Locals      *frame;
     struct List *next;
 } List;
 
+// List cells are carved out of pages holding CELLS_PER_PAGE of
+// them. Freed cells go to a free list and are reused before the
+// next page is touched; pages themselves are released all at
+// once by releaseCells().
+#define CELLS_PER_PAGE 4096
+
+typedef struct CellPage {
+    struct CellPage *next;
+    List            cells[CELLS_PER_PAGE];
+} CellPage;
+
+__thread CellPage *cellPages = NULL;
+__thread List     *freeCells = NULL;
+__thread uint     cellsUsed = CELLS_PER_PAGE;
+__thread uint64_t cellAllocs = 0;
+
+List *allocCell () {
+    cellAllocs++;
+
+    if(freeCells != NULL) {
+        List *ans = freeCells;
+        freeCells = ans->next;
+        return ans;
+    }
+
+    if(cellsUsed == CELLS_PER_PAGE) {
+        CellPage *page = malloc(sizeof(CellPage));
+        if(page == NULL) {
+            fprintf(stderr, "out of memory\n");
+            fail(1);
+        }
+
+        #ifdef DEBUG_MEM
+        fprintf(stderr, "new cell page %p\n", page);
+        #endif
+
+        page->next = cellPages;
+        cellPages = page;
+        cellsUsed = 0;
+    }
+
+    return cellPages->cells + cellsUsed++;
+}
+
+void freeCell (List *cell) {
+    cell->next = freeCells;
+    freeCells = cell;
+}
+
+void releaseCells () {
+    while(cellPages != NULL) {
+        CellPage *next = cellPages->next;
+
+        #ifdef DEBUG_MEM
+        fprintf(stderr, "releasing cell page %p\n", cellPages);
+        #endif
+
+        free(cellPages);
+        cellPages = next;
+    }
+
+    freeCells = NULL;
+    cellsUsed = CELLS_PER_PAGE;
+}
+
 List *cons(Symbol value, List *before) {
-    List *ans = malloc(sizeof(List));
+    List *ans = allocCell();
     *ans = (List) {
         .val = value,
         .refs = 1,
+        .local = 0,
+        .link = LINK_NONE,
+        .bound = NULL,
+        .frame = NULL,
         .next = before
     };
 
     #ifdef DEBUG_MEM
     fprintf(stderr, "cons %p: ", ans);
-    printSymbol(stderr, value);
+    printSymbol(&errw, value);
     fprintf(stderr, "\n");
     #endif 
 
@@ -264,41 +944,55 @@ List *cons(Symbol value, List *before) {
 }
 
 void freeList (List *l) {
-    if(l == NULL) return;
-
-    #ifdef DEBUG_MEM
-    fprintf(stderr, "freeing %p (%u refs): ", l, l->refs);
-    printSymbol(stderr, l->val);
-    fprintf(stderr, "\n");
-    #endif
-
-    if(l->refs-- > 1) return;
-
-    if(l->val.type == LIST) {
-        freeList(l->val.value.list);
-    }
+    // Walks the spine in a loop, so long lists don't blow the C stack.
+    while(l != NULL) {
+        #ifdef DEBUG_MEM
+        fprintf(stderr, "freeing %p (%u refs): ", l, l->refs);
+        printSymbol(&errw, l->val);
+        fprintf(stderr, "\n");
+        #endif
+
+        if(refDec(&l->refs) > 0) return;
+
+        if(l->val.text != NULL) {
+            releaseText(l->val.text);
+        }
+        if(l->val.type == LIST) {
+            freeList(l->val.value.list);
+        }
 
-    if(l->val.type == ARRAY) {
-        free_StringArray(l->val.value.array);
-    }
-    if(l->val.type == SOURCE) {
-        close_source(l->val.value.source);
-    }
+        if(l->val.type == ARRAY) {
+            free_StringArray(l->val.value.array);
+        }
+        if(l->val.type == SOURCE) {
+            close_source(l->val.value.source);
+        }
+        if(l->val.type == BUILDER) {
+            releaseBuilder(l->val.value.builder);
+        }
+        if(l->val.type == VECTOR) {
+            releaseVector(l->val.value.vector);
+        }
+        if(l->val.type == DEQUE) {
+            releaseDeque(l->val.value.deque);
+        }
+        if(l->val.type == STREAM) {
+            releaseStream(l->val.value.stream);
+        }
 
-    if(l->next != NULL) {
-        freeList(l->next);
+        List *next = l->next;
+        freeCell(l);
+        l = next;
     }
-
-    free(l);
 }
 
 List *cloneListUntil(List *l, List *last) {
     if(l == NULL) return NULL;
 
-    List *ans = cons(l->val, NULL);
+    List *ans = cons(refsym(l->val), NULL);
     List *wcur = ans;
     for(List *cur = l->next; cur != NULL && cur != last; cur = cur->next) {
-        wcur->next = cons(cur->val, NULL);
+        wcur->next = cons(refsym(cur->val), NULL);
         wcur = wcur->next;
     }
 
@@ -312,7 +1006,7 @@ List *joinLists(List *a, List *b) {
     List *cur = a;
     while(cur->next != NULL) cur=cur->next;
     cur->next = b;
-    b->refs++;
+    refInc(&b->refs);
     return a;
 }
 
@@ -322,10 +1016,10 @@ List *splitList(List **l, uint index) {
     List *cur = *l;
     bool needs_clone = false;
     for(uint i = 1; i < index; i++) {
-        needs_clone |= (cur->refs > 1);
+        needs_clone |= (refCount(&cur->refs) > 1);
         cur = cur->next;
     }
-    needs_clone |= (cur->refs > 1);
+    needs_clone |= (refCount(&cur->refs) > 1);
 
     List *ans = *l;
     if(needs_clone) {
@@ -338,10 +1032,20 @@ List *splitList(List **l, uint index) {
 }
 
 Symbol refsym(Symbol s) {
+    if(s.text != NULL) refInc(&s.text->refs);
+
     if(s.type == LIST && s.value.list != NULL) {
-        s.value.list->refs++;
+        refInc(&s.value.list->refs);
     } else if (s.type == ARRAY) {
-        s.value.array.refs++;
+        refInc(&s.value.array.refs);
+    } else if (s.type == BUILDER) {
+        refInc(&s.value.builder->refs);
+    } else if (s.type == VECTOR) {
+        refInc(&s.value.vector->refs);
+    } else if (s.type == DEQUE) {
+        refInc(&s.value.deque->refs);
+    } else if (s.type == STREAM) {
+        refInc(&s.value.stream->refs);
     }
 
     return s;
@@ -378,7 +1082,7 @@ Symbol pop(List **l) {
 
     #ifdef DEBUG_MEM
     fprintf(stderr, "popping %p: ", *l);
-    printSymbol(stderr, (*l)->val);
+    printSymbol(&errw, (*l)->val);
     fprintf(stderr, "\n");
     #endif
 
@@ -386,18 +1090,116 @@ Symbol pop(List **l) {
 
     List *old = *l;
     *l = (*l)->next;
-    if(*l != NULL) (*l)->refs++;
-    if(old->refs-- == 1)
-        free(old);
+    if(*l != NULL) refInc(&(*l)->refs);
+    if(refDec(&old->refs) == 0)
+        freeCell(old);
 
     return s;    
 }
 
-void pushStr(List **l, String s) {
-    *l = cons((Symbol) {
+void stackReserve (Stack *st, size_t n) {
+    if(st->len + n <= st->cap) return;
+
+    while(st->len + n > st->cap)
+        st->cap = (st->cap == 0) ? 64 : st->cap * 2;
+
+    st->data = realloc(st->data, st->cap * sizeof(Symbol));
+    if(st->data == NULL) {
+        fprintf(stderr, "out of memory\n");
+        fail(1);
+    }
+}
+
+void push (RunEnv *env, Symbol s) {
+    Stack *st = &(env->stack);
+    if(st->len == st->cap) stackReserve(st, 1);
+    st->data[st->len++] = s;
+}
+
+Symbol popStack (RunEnv *env) {
+    if(env->stack.len == 0) return Nothing;
+    return env->stack.data[--env->stack.len];
+}
+
+// depth 0 is the top, NULL if stack is not deep enough.
+Symbol *peek (RunEnv *env, size_t depth) {
+    if(depth >= env->stack.len) return NULL;
+    return env->stack.data + env->stack.len - 1 - depth;
+}
+
+void pushString (RunEnv *env, String s) {
+    push(env, (Symbol) {
                 .word = s,
                 .type = STRING,
-                .value.string = s }, *l);
+                .value.string = s });
+}
+
+void pushInt (RunEnv *env, int val) {
+    push(env, (Symbol) {
+                .word = constString(""),
+                .type = INT,
+                .value.integer = val });
+}
+
+void pushChar (RunEnv *env, char val) {
+    push(env, (Symbol) {
+                .word = constString(""),
+                .type = CHAR,
+                .value.character = val });
+}
+
+void pushBool (RunEnv *env, bool val) {
+    push(env, (Symbol) {
+                .word = val ? constString("true") : constString("false"),
+                .type = BOOLEAN,
+                .value.boolean = val });
+}
+
+void pushList (RunEnv *env, List *list) {
+    push(env, listSymbol("", list));
+}
+
+// What stack symbol owns, is released with it.
+void dropSym (Symbol s) {
+    if(s.text != NULL) releaseText(s.text);
+
+    if(s.type == LIST) freeList(s.value.list);
+    else if(s.type == BUILDER) releaseBuilder(s.value.builder);
+    else if(s.type == VECTOR) releaseVector(s.value.vector);
+    else if(s.type == DEQUE) releaseDeque(s.value.deque);
+    else if(s.type == STREAM) releaseStream(s.value.stream);
+}
+
+void releaseVector (Vector *v) {
+    if(refDec(&v->refs) > 0) return;
+
+    for(size_t i = 0; i < v->len; i++)
+        dropSym(v->data[i]);
+    free(v->data);
+    free(v);
+}
+
+void releaseDeque (Deque *d) {
+    if(refDec(&d->refs) > 0) return;
+
+    for(size_t i = 0; i < d->len; i++)
+        dropSym(*dequeAt(d, i));
+    free(d->data);
+    free(d);
+}
+
+// Moves stack symbols from index from up to the top
+// into a list, keeping their order.
+List *stackSlice (RunEnv *env, size_t from) {
+    List *ans = NULL;
+    List **wcur = &ans;
+    for(size_t i = from; i < env->stack.len; i++) {
+        *wcur = cons(env->stack.data[i], NULL);
+        wcur = &((*wcur)->next);
+    }
+
+    env->stack.len = from;
+    return ans;
 }
 
 List *consList(List *into, List *list) {
@@ -414,24 +1216,7 @@ List *consInt(int val, List *list) {
                 .value.integer = val}, list);
 }
 
-List *consChar(char val, List *list) {
-    return cons((Symbol) {
-                .word = constString(""),
-                .type = CHAR,
-                .value.character = val}, list);
-}
-
-List *consBool(bool val, List *list) {
-    String name;
-    if(val) name = constString("true");
-    else name = constString("false");
 
-    return cons((Symbol) {
-                .word = name,
-                .type = BOOLEAN,
-                .value.boolean = val
-           }, list);
-}
 
 List *consString(String str, List *tail) {
     return cons((Symbol) {
@@ -455,10 +1240,10 @@ List *reverseList(List *tgt) {
 List *reversedList(List *src) {
     if(src == NULL) return NULL;
 
-    List *ans = cons(src->val, NULL);
+    List *ans = cons(refsym(src->val), NULL);
     while(src->next != NULL) {
         src = src->next;
-        ans = cons(src->val, ans);
+        ans = cons(refsym(src->val), ans);
     }
 
     return ans;
@@ -473,39 +1258,496 @@ Symbol find(String name, List *list) {
     return Nothing;
 }
 
-Symbol findVar(RunEnv *env, String name) {
-    if(env->scopeStack != NULL) {
-        Symbol sym = find(name, env->scopeStack->val.value.list);
-        if(sym.type != NOTHING) return sym;
+// Globals are kept in defs list (newest first, as fn pushes
+// them), while the open-addressing table maps each name to a
+// slot holding its newest definition, so shadowing works just
+// like with find(). Slots never move, so fn bodies can keep
+// pointers to them (see linkBody()).
+struct GlobalSlot {
+    String  name;       // points to copy, so it outlives its source
+    uint    hash;
+    SymTab  *owner;
+    List    *def;       // NULL while the name is not defined
+    bool    shadowed;   // name was ever bound as a variable
+    uint    traceId;    // 0 until the word is first traced
+    char    copy[];
+};
+
+struct SymTab {
+    GlobalSlot  **slots;
+    uint        cap, count;
+    List        *defs;
+    Locals      *frames;    // layouts made by linkLocals()
+    SymTab      *quotes;    // ( and ) of quote mode, made on first use
+};
+
+// Names a fn body binds with assign or extract get numbered
+// slots. eval() gives each call of the fn a frame of them, so
+// reading a local is an indexed load. Slots are Nothing until
+// assigned, just like unbound names.
+struct Locals {
+    uint    count;
+    String  *names;
+    Locals  *next;
+};
+
+uint stringHash (String s) {
+    uint h = 2166136261u;
+    for(size_t i = 0; i < s.len; i++) {
+        h ^= (unsigned char) s.data[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+GlobalSlot **symtabSlot (SymTab *tab, String name, uint hash) {
+    uint mask = tab->cap - 1;
+    for(uint i = hash & mask;; i = (i + 1) & mask) {
+        GlobalSlot **e = tab->slots + i;
+        if(*e == NULL
+           || ((*e)->hash == hash && stringEq((*e)->name, name)))
+            return e;
+    }
+}
+
+// Makes room for count names, keeping cap a power of two and the
+// table at most 3/4 full.
+void symtabReserve (SymTab *tab, uint count) {
+    uint cap = (tab->cap == 0) ? 128 : tab->cap;
+    while(count * 4 > cap * 3) cap *= 2;
+    if(cap == tab->cap) return;
+
+    GlobalSlot **old = tab->slots;
+    uint oldcap = tab->cap;
+
+    tab->cap = cap;
+    tab->slots = calloc(tab->cap, sizeof(GlobalSlot*));
+
+    for(uint i = 0; i < oldcap; i++) {
+        if(old[i] != NULL)
+            *symtabSlot(tab, old[i]->name, old[i]->hash) = old[i];
+    }
+
+    free(old);
+}
+
+GlobalSlot *symtabIntern (SymTab *tab, String name) {
+    if((tab->count + 1) * 4 > tab->cap * 3)
+        symtabReserve(tab, tab->count + 1);
+
+    uint hash = stringHash(name);
+    GlobalSlot **e = symtabSlot(tab, name, hash);
+    if(*e == NULL) {
+        *e = malloc(sizeof(GlobalSlot) + name.len);
+        memcpy((*e)->copy, name.data, name.len);
+        **e = (GlobalSlot) {
+            .name = { .data = (*e)->copy, .len = name.len },
+            .hash = hash,
+            .owner = tab,
+            .def = NULL,
+            .shadowed = false,
+            .traceId = 0
+        };
+        tab->count++;
+    }
+
+    return *e;
+}
+
+void symtabDefine (SymTab *tab, List *cell) {
+    cell->next = tab->defs;
+    tab->defs = cell;
+    symtabIntern(tab, cell->val.word)->def = cell;
+}
+
+SymTab mkSymTab (List *defs) {
+    SymTab ans = {
+        .slots = NULL,
+        .cap = 0,
+        .count = 0,
+        .defs = defs,
+        .frames = NULL,
+        .quotes = NULL
+    };
+
+    // Sized once for the whole initial table, instead of growing
+    // through it.
+    uint count = 0;
+    for(List *cur = defs; cur != NULL; cur = cur->next)
+        count++;
+    symtabReserve(&ans, count);
+
+    // defs is newest first, so only first occurence counts.
+    for(List *cur = defs; cur != NULL; cur = cur->next) {
+        GlobalSlot *slot = symtabIntern(&ans, cur->val.word);
+        if(slot->def == NULL) slot->def = cur;
+    }
+
+    return ans;
+}
+
+void freeSymTab (SymTab *tab) {
+    freeList(tab->defs);
+    if(tab->quotes != NULL) {
+        freeSymTab(tab->quotes);
+        free(tab->quotes);
+    }
+    while(tab->frames != NULL) {
+        Locals *next = tab->frames->next;
+        free(tab->frames->names);
+        free(tab->frames);
+        tab->frames = next;
+    }
+    for(uint i = 0; i < tab->cap; i++)
+        free(tab->slots[i]);
+    free(tab->slots);
+    *tab = (SymTab) { .slots = NULL };
+}
+
+Symbol findGlobal(SymTab *tab, String name) {
+    if(tab->cap == 0) return Nothing;
+
+    GlobalSlot *slot = *symtabSlot(tab, name, stringHash(name));
+    if(slot == NULL || slot->def == NULL) return Nothing;
+
+    return slot->def->val;
+}
+
+// Binds every symbol in body (and nested lists, which may be
+// evaluated later as blocks) to its global slot. Slot holds
+// the newest definition, so later fn redefinitions are picked
+// up. Names bound as variables are marked shadowed by
+// assign/extract, and such cells fall back to findVar().
+//
+// Literals left as symbols, as in bodies made by tokenize, are
+// resolved here instead of on every run: #c and numbers become
+// ints, quoted names LINK_CONST cells. Neither gets a slot.
+void linkBody (SymTab *tab, List *body) {
+    for(List *cur = body; cur != NULL; cur = cur->next) {
+        if(cur->val.type == LIST) {
+            linkBody(tab, cur->val.value.list);
+            continue;
+        }
+        if(cur->val.type != SYMBOL || stringEq(cur->val.word, Nothing.word))
+            continue;
+
+        Symbol lit = specialSym(cur->val);
+        if(lit.type == INT) {
+            lit.text = cur->val.text;
+            cur->val = lit;
+        } else if(lit.word.data != cur->val.word.data) {
+            cur->link = LINK_CONST;
+        } else {
+            cur->bound = symtabIntern(tab, cur->val.word);
+        }
+    }
+}
+
+void shadowGlobal (RunEnv *env, String name) {
+    if(!env->inPmap) {
+        symtabIntern(env->globals, name)->shadowed = true;
+        return;
+    }
+
+    // Other threads may be reading the table, so it can't grow.
+    // A name without a slot has no linked cells to mark.
+    if(env->globals->cap == 0) return;
+    GlobalSlot *slot = *symtabSlot(env->globals, name, stringHash(name));
+    if(slot != NULL && !__atomic_load_n(&slot->shadowed, __ATOMIC_RELAXED))
+        __atomic_store_n(&slot->shadowed, true, __ATOMIC_RELAXED);
+}
+
+int localIndex (Locals *frame, String name) {
+    for(uint i = 0; i < frame->count; i++) {
+        if(stringEq(frame->names[i], name)) return i;
+    }
+
+    return -1;
+}
+
+Symbol *frameSlot (RunEnv *env, uint local) {
+    return env->locals.data + env->frameBase + local;
+}
+
+// Plain symbol, which evaluates to itself when unbound.
+bool isName (Symbol s) {
+    if(s.type != SYMBOL || stringEq(s.word, Nothing.word)) return false;
+
+    Symbol sp = specialSym(s);
+    return sp.type == SYMBOL && sp.word.data == s.word.data;
+}
+
+bool callsBuiltin (SymTab *tab, List *cell, void (*builtin) (RunEnv *env)) {
+    if(cell == NULL || cell->val.type != SYMBOL) return false;
+
+    Symbol s = findGlobal(tab, cell->val.word);
+    return s.type == BUILTIN && s.value.builtin == builtin;
+}
+
+void addLocal (SymTab *tab, Locals *frame, Symbol s) {
+    // Globals keep their meaning (and assign error).
+    if(!isName(s) || findGlobal(tab, s.word).type != NOTHING
+       || localIndex(frame, s.word) >= 0)
+        return;
+
+    frame->names = realloc(frame->names, (frame->count + 1) * sizeof(String));
+    frame->names[frame->count++] = s.word;
+}
+
+void collectSchema (SymTab *tab, Locals *frame, List *schema) {
+    for(List *cur = schema; cur != NULL; cur = cur->next) {
+        if(cur->val.type == LIST) collectSchema(tab, frame, cur->val.value.list);
+        else addLocal(tab, frame, cur->val);
+    }
+}
+
+void collectLocals (SymTab *tab, Locals *frame, List *body) {
+    for(List *cur = body; cur != NULL; cur = cur->next) {
+        if(cur->val.type == LIST) {
+            collectLocals(tab, frame, cur->val.value.list);
+            if(callsBuiltin(tab, cur->next, &builtin_extract))
+                collectSchema(tab, frame, cur->val.value.list);
+        } else if(callsBuiltin(tab, cur->next, &builtin_assign)) {
+            addLocal(tab, frame, cur->val);
+        }
+    }
+}
+
+void markSchema (Locals *frame, List *schema) {
+    for(List *cur = schema; cur != NULL; cur = cur->next) {
+        if(cur->val.type == LIST) {
+            markSchema(frame, cur->val.value.list);
+        } else if(cur->val.type == SYMBOL) {
+            int local = localIndex(frame, cur->val.word);
+            if(local >= 0) {
+                cur->link = LINK_NAME;
+                cur->local = local;
+            }
+        }
+    }
+}
+
+void markLocals (SymTab *tab, Locals *frame, List *body) {
+    for(List *cur = body; cur != NULL; cur = cur->next) {
+        if(cur->link == LINK_CONST) continue;
+
+        cur->frame = frame;
+        cur->link = LINK_NONE;
+        cur->local = 0;
+
+        if(cur->val.type == LIST) {
+            markLocals(tab, frame, cur->val.value.list);
+            if(callsBuiltin(tab, cur->next, &builtin_extract))
+                markSchema(frame, cur->val.value.list);
+            continue;
+        }
+
+        int local = (cur->val.type == SYMBOL)
+                        ? localIndex(frame, cur->val.word) : -1;
+        if(local < 0) continue;
+
+        cur->local = local;
+        if(callsBuiltin(tab, cur->next, &builtin_assign)) {
+            cur->link = LINK_NAME;
+            cur = cur->next;
+            cur->frame = frame;
+            cur->link = LINK_STORE;
+            cur->local = local;
+        } else {
+            cur->link = LINK_LOCAL;
+        }
+    }
+}
+
+// Gives body its frame layout, the head cell keeps it for eval().
+// Names of locals are shadowed, so linked cells of other bodies,
+// which may run inside of this frame, look them up by name.
+void linkLocals (SymTab *tab, List *body) {
+    Locals frame = { .count = 0, .names = NULL, .next = tab->frames };
+    collectLocals(tab, &frame, body);
+    if(frame.count == 0) return;
+
+    Locals *layout = malloc(sizeof(Locals));
+    *layout = frame;
+    tab->frames = layout;
+    for(uint i = 0; i < frame.count; i++)
+        symtabIntern(tab, frame.names[i])->shadowed = true;
+
+    markLocals(tab, layout, body);
+}
+
+Symbol findVar(RunEnv *env, String name) {
+    if(env->frame != NULL) {
+        int local = localIndex(env->frame, name);
+        if(local >= 0 && frameSlot(env, local)->type != NOTHING)
+            return *frameSlot(env, local);
+    }
+
+    if(env->scopeStack != NULL) {
+        Symbol sym = find(name, env->scopeStack->val.value.list);
+        if(sym.type != NOTHING) return sym;
+    }
+
+    return findGlobal(env->globals, name);
+}
+
+// Bindings of the top scope end where the enclosing scope's
+// begin, anonymous bodies share the tail of their parent's list.
+List *outerVars (RunEnv *env) {
+    return (env->scopeStack->next != NULL)
+                ? env->scopeStack->next->val.value.list
+                : NULL;
+}
+
+// Binds name in the top scope, val is owned by the binding. If
+// the scope already has a binding of name, it is updated in place,
+// so rebinding in loops doesn't grow the scope.
+void bindVar (RunEnv *env, String name, Symbol val) {
+    List **vars = &(env->scopeStack->val.value.list);
+    List *outer = outerVars(env);
+
+    val.word = name;
+    for(List *cur = *vars; cur != outer && cur != NULL; cur = cur->next) {
+        if(stringEq(cur->val.word, name)) {
+            dropSym(cur->val);
+            cur->val = val;
+            return;
+        }
+    }
+
+    shadowGlobal(env, name);
+    *vars = cons(val, *vars);
+}
+
+// Pops the top scope with bindings it made.
+void popScope (RunEnv *env) {
+    List *outer = outerVars(env);
+    List *cur = env->scopeStack->val.value.list;
+    while(cur != outer && cur != NULL) {
+        List *next = cur->next;
+        dropSym(cur->val);
+        freeCell(cur);
+        cur = next;
     }
 
-    return find(name, env->globals);
+    pop(&(env->scopeStack));
+}
+
+bool isListType (int type) {
+    return type == LIST || type == FUNCTION || type == SCOPE;
 }
 
-void printSymbol (FILE *out, Symbol s) {
+void printAtom (Writer *out, Symbol s) {
     if(s.type == ARRAY) printStringArray(out, s.word, s.value.array);    
-    else if (s.type == STRING)
-        fprintf(out, "\"%.*s\" ", (int)s.value.string.len, s.value.string.data);
-    else if (s.type == SYMBOL)
-        fprintf(out, "%.*s ", (int)s.value.string.len, s.value.string.data);
-    else if (s.type == SOURCE)
-        fprintf(out, "SOURCE %.*s ", (int)s.word.len, s.word.data);
-    else if (s.type == LIST || s.type == FUNCTION || s.type == SCOPE) {
-        fprintf(out, "( ");
-        for(List *l = s.value.list; l != NULL; l = l->next) {
-            printSymbol(out, l->val);
-        }
-        fprintf(out, ")");
+    else if (s.type == STRING) {
+        writeChar(out, '"');
+        writeStr(out, s.value.string);
+        writeConst(out, "\" ");
+    } else if (s.type == SYMBOL) {
+        writeStr(out, s.value.string);
+        writeChar(out, ' ');
+    } else if (s.type == BUILDER) {
+        writeChar(out, '"');
+        writeBytes(out, s.value.builder->data, s.value.builder->len);
+        writeConst(out, "\" ");
+    } else if (s.type == SOURCE) {
+        writeConst(out, "SOURCE ");
+        writeStr(out, s.word);
+        writeChar(out, ' ');
+    } else if (s.type == STREAM) {
+        writeConst(out, "STREAM ");
+        writeStr(out, s.value.stream->name);
+        writeChar(out, ' ');
     } else if (s.type == CHAR) {
-        fprintf(out, "'%c' ", s.value.character);
+        writeChar(out, '\'');
+        writeChar(out, s.value.character);
+        writeConst(out, "' ");
     } else if (s.type == INT) {
-        fprintf(out, "%d ", s.value.integer);
+        writeInt(out, s.value.integer);
+        writeChar(out, ' ');
+    } else {
+        writeStr(out, s.word);
+        writeChar(out, ' ');
     }
-    else
-        fprintf(out, "%.*s ", (int)s.word.len, s.word.data);
 }
 
-void printList (FILE* out, List *l) {
+// Nested lists are walked with an explicit stack of cells to
+// continue with, so deep ones don't take the C stack.
+void printSymbol (Writer *out, Symbol s) {
+    if(s.type == VECTOR) {
+        Vector *v = s.value.vector;
+        writeConst(out, "[ ");
+        for(size_t i = 0; i < v->len; i++)
+            printSymbol(out, v->data[i]);
+        writeChar(out, ']');
+        if(out->autoflush) flushWriter(out);
+        return;
+    }
+
+    if(s.type == DEQUE) {
+        Deque *d = s.value.deque;
+        writeConst(out, "[ ");
+        for(size_t i = 0; i < d->len; i++)
+            printSymbol(out, *dequeAt(d, i));
+        writeChar(out, ']');
+        if(out->autoflush) flushWriter(out);
+        return;
+    }
+
+    if(!isListType(s.type)) {
+        printAtom(out, s);
+        if(out->autoflush) flushWriter(out);
+        return;
+    }
+
+    List *inplace[32];
+    List **rest = inplace;
+    size_t depth = 0, cap = 32;
+
+    writeConst(out, "( ");
+    List *cur = s.value.list;
+    while(true) {
+        if(cur == NULL) {
+            writeChar(out, ')');
+            if(depth == 0) break;
+            cur = rest[--depth];
+        } else if(isListType(cur->val.type)) {
+            if(depth == cap) {
+                cap *= 2;
+                if(rest == inplace) {
+                    rest = malloc(cap * sizeof(List*));
+                    memcpy(rest, inplace, sizeof(inplace));
+                } else {
+                    rest = realloc(rest, cap * sizeof(List*));
+                }
+            }
+
+            rest[depth++] = cur->next;
+            writeConst(out, "( ");
+            cur = cur->val.value.list;
+        } else {
+            if(cur->val.type == VECTOR || cur->val.type == DEQUE)
+                printSymbol(out, cur->val);
+            else printAtom(out, cur->val);
+            cur = cur->next;
+        }
+    }
+
+    if(rest != inplace) free(rest);
+    if(out->autoflush) flushWriter(out);
+}
+
+void printStack (Writer *out, RunEnv *env) {
+    writeConst(out, "( ");
+    for(size_t i = env->stack.len; i > 0; i--) {
+        printSymbol(out, env->stack.data[i-1]);
+    }
+    writeChar(out, ')');
+    if(out->autoflush) flushWriter(out);
+}
+
+void printList (Writer *out, List *l) {
     printSymbol(out, (Symbol) {.word = constString(""),
                                   .type = LIST,
                                   .value.list = l });
@@ -679,6 +1921,26 @@ List *initial_global_symtab (int argc, const char **argv) {
                     .type = BUILTIN,
                     .value.builtin = &builtin_dbgoff
                 }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("+prof"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_profon
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("-prof"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_profoff
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("+trace"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_traceon
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("-trace"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_traceoff
+                }, ans);
     ans = cons( (Symbol) {
                     .word = constString(">int"),
                     .type = BUILTIN,
@@ -694,6 +1956,56 @@ List *initial_global_symtab (int argc, const char **argv) {
                     .type = BUILTIN,
                     .value.builtin = &builtin_toStr
                 }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("builder"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_builder
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("<<"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_appendText
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString(">vec"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_toVec
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString(">lst"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_toLst
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("deque"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_deque
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("popLast"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_popLast
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("stream"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_stream
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("line"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_line
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("eachLine"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_eachLine
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("pmap"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_pmap
+                }, ans);
     ans = cons( (Symbol) {
                     .word = constString("exit"),
                     .type = BUILTIN,
@@ -704,6 +2016,21 @@ List *initial_global_symtab (int argc, const char **argv) {
                     .type = BUILTIN,
                     .value.builtin = &builtin_cut
                 }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("split"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_split
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("indexOf"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_indexOf
+                }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("contains"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_contains
+                }, ans);
     ans = cons( (Symbol) {
                     .word = constString("match"),
                     .type = BUILTIN,
@@ -779,6 +2106,11 @@ List *initial_global_symtab (int argc, const char **argv) {
                     .type = BUILTIN,
                     .value.builtin = &builtin_content
                 }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("flush"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_flush
+                }, ans);
     ans = cons( (Symbol) {
                     .word = constString(";"),
                     .type = BUILTIN,
@@ -804,6 +2136,11 @@ List *initial_global_symtab (int argc, const char **argv) {
                     .type = BUILTIN,
                     .value.builtin = &builtin_cons
                 }, ans);
+    ans = cons( (Symbol) {
+                    .word = constString("tokenize"),
+                    .type = BUILTIN,
+                    .value.builtin = &builtin_tokenize
+                }, ans);
 
     return ans;
 }
@@ -863,126 +2200,542 @@ Symbol specialSym(Symbol s) {
 
 void eval (Symbol body, RunEnv *env);
 
-void evalSym (Symbol insym, RunEnv *env) {
-    if(dbg) {
-        fprintf(stderr, "eval: ");
-        printSymbol(stderr, insym);
-        if(env->stack) {
-            putc(' ', stderr);
-            printSymbol(stderr, env->stack->val);
-        }
-        putc('\n', stderr);
-    }
+// Builtins which evaluate a body as their last action call it
+// at entry. If true, they should pass the body to evalTail().
+bool takeTailPos (RunEnv *env) {
+    bool tail = env->tailPos;
+    env->tailPos = false;
+    return tail;
+}
 
-    if(stringEq(insym.word, Nothing.word)) {
-        env->stack = cons(Nothing, env->stack);
-        return;
-    }
+// owned is set, when body.value.list should be freed once
+// evaluated.
+void evalTail (Symbol body, bool owned, RunEnv *env) {
+    env->tail = body;
+    env->tailOwned = owned;
+    env->hasTail = true;
+}
 
-    if(insym.type != SYMBOL) {
-        env->stack = cons(refsym(insym), env->stack);
-        return;
+// Profiler, enabled by +prof or --prof. Every builtin call and
+// named fn activation gets a frame; on leave its time and cell
+// allocations are added to the word's entry, and subtracted from
+// the parent's self figures. Report is printed at exit. Entries
+// also give words their ids in the execution trace.
+typedef struct ProfEntry {
+    String      name;
+    uint        hash;
+    uint        id;
+    uint        active;     // recursion depth, for total time
+    uint64_t    calls, total, self, allocs;
+} ProfEntry;
+
+typedef struct ProfFrame {
+    ProfEntry   *entry;
+    uint64_t    start, children, allocs, childAllocs;
+} ProfFrame;
+
+__thread bool        prof = false;
+__thread ProfEntry   **profEntries = NULL;
+__thread uint        profCap = 0, profCount = 0;
+__thread ProfFrame   *profFrames = NULL;
+__thread uint        profDepth = 0, profFramesCap = 0;
+
+uint64_t profClock () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+ProfEntry **profSlot (ProfEntry **entries, uint cap, String name, uint hash) {
+    uint mask = cap - 1;
+    for(uint i = hash & mask;; i = (i + 1) & mask) {
+        ProfEntry **e = entries + i;
+        if(*e == NULL
+           || ((*e)->hash == hash && stringEq((*e)->name, name)))
+            return e;
     }
+}
 
-    Symbol s = findVar(env, insym.word);
-    if(s.type != NOTHING) {
-        if(s.type == BUILTIN) {
-            s.value.builtin(env);
-        } else if(s.type == FUNCTION) {
-            eval(s, env);
-        } else {
-            env->stack = cons(refsym(s), env->stack);
+ProfEntry *profEntry (String name) {
+    if((profCount + 1) * 4 > profCap * 3) {
+        uint oldcap = profCap;
+        ProfEntry **old = profEntries;
+
+        profCap = (oldcap == 0) ? 128 : oldcap * 2;
+        profEntries = calloc(profCap, sizeof(ProfEntry*));
+        for(uint i = 0; i < oldcap; i++) {
+            if(old[i] != NULL)
+                *profSlot(profEntries, profCap, old[i]->name, old[i]->hash) = old[i];
         }
-    } else {
-        env->stack = cons(specialSym(insym), env->stack);
+        free(old);
     }
 
-    if(dbg && env->stack) {
-        fprintf(stderr, " >> ");
-        printSymbol(stderr, env->stack->val);
-        putc('\n', stderr);
+    uint hash = stringHash(name);
+    ProfEntry **e = profSlot(profEntries, profCap, name, hash);
+    if(*e == NULL) {
+        // Words may point into sources which are unmapped before
+        // the report is printed.
+        char *copy = malloc(name.len);
+        memcpy(copy, name.data, name.len);
+
+        *e = calloc(1, sizeof(ProfEntry));
+        (*e)->name = (String) { .data = copy, .len = name.len };
+        (*e)->hash = hash;
+        (*e)->id = ++profCount;
     }
-}
 
-void eval (Symbol body, RunEnv *env) {
-    env->scopeStack = cons((Symbol) {
-                             .word = (body.word.len > 0)
-                                                ?body.word
-                                                :constString("(eval)"),
-                             .type = SCOPE,
-                             .value.list = (body.word.len > 0)
-                                                ?NULL
-                                                :env->scopeStack->val.value.list },
-                            env->scopeStack);
+    return *e;
+}
 
-    for(List *cur = body.value.list; cur != NULL; cur = cur->next) {
-        evalSym(cur->val, env);
+void profEnter (String name) {
+    if(profDepth == profFramesCap) {
+        profFramesCap = (profFramesCap == 0) ? 64 : profFramesCap * 2;
+        profFrames = realloc(profFrames, profFramesCap * sizeof(ProfFrame));
     }
 
-    pop(&(env->scopeStack));
+    ProfEntry *e = profEntry(name);
+    e->calls++;
+    e->active++;
+    profFrames[profDepth++] = (ProfFrame) {
+        .entry = e,
+        .start = profClock(),
+        .children = 0,
+        .allocs = cellAllocs,
+        .childAllocs = 0
+    };
 }
 
-void run_source(Source root, List **vars) {
-    RunEnv env = { .stack = NULL,
-                   .globals = *vars,
-                   .scopeStack = consList(NULL, NULL) };
+void profLeave () {
+    ProfFrame *f = profFrames + --profDepth;
+    uint64_t time = profClock() - f->start;
+    uint64_t allocs = cellAllocs - f->allocs;
 
-    uint symbols_count = count_symbols(root);
+    // Outermost activation only, so recursion isn't counted twice.
+    if(--f->entry->active == 0)
+        f->entry->total += time;
+    f->entry->self += time - f->children;
+    f->entry->allocs += allocs - f->childAllocs;
+
+    if(profDepth > 0) {
+        profFrames[profDepth-1].children += time;
+        profFrames[profDepth-1].childAllocs += allocs;
+    }
+}
 
-    StringArray symbols = mk_StringArray(symbols_count);
-    load_symbols (root, symbols, 0);
+int profCompare (const void *a, const void *b) {
+    uint64_t x = (*(ProfEntry**)a)->self, y = (*(ProfEntry**)b)->self;
+    return (x < y) - (x > y);
+}
 
-    for(uint i = 0; i < symbols.len; i++) {
-        String current = symbols.data[i];
-        
-        if(stringEq(current, Nothing.word)) {
-            env.stack = cons(Nothing, env.stack);
-            continue;
-        }
-        
-        Symbol val = findVar(&env, current);
+void profReport () {
+    flushOutput();
 
-        if(val.type == BUILTIN) {
-            val.value.builtin(&env);
-        } else if (val.type == FUNCTION) {
-            eval(val, &env);
-        } else if (val.type == NOTHING) {
-            env.stack = cons(specialSym((Symbol){
-                                    .word = current,
-                                    .type = SYMBOL,
-                                    .value.string = current}),
-                         env.stack);
-        } else {
-            env.stack = cons(refsym(val), env.stack);
-        }
+    // exit may be called from inside of profiled words.
+    while(profDepth > 0) profLeave();
+    if(profCount == 0) return;
 
-        *vars = env.globals;
+    ProfEntry **sorted = malloc(profCount * sizeof(ProfEntry*));
+    uint n = 0;
+    for(uint i = 0; i < profCap; i++) {
+        if(profEntries[i] != NULL && profEntries[i]->calls > 0)
+            sorted[n++] = profEntries[i];
     }
+    qsort(sorted, n, sizeof(ProfEntry*), &profCompare);
 
-    if(env.stack != NULL) {
-        printf("\n");
-        printSymbol(stdout, (Symbol) {
-            .word=constString("stack"),
-            .type=LIST,
-            .value.list = env.stack});
-        printf("\n");
+    if(n > 0) {
+        fprintf(stderr, "\n%10s %12s %12s %10s  %s\n",
+                "calls", "total ms", "self ms", "allocs", "word");
+    }
+    for(uint i = 0; i < n; i++) {
+        ProfEntry *e = sorted[i];
+        fprintf(stderr, "%10llu %12.3f %12.3f %10llu  %.*s\n",
+                (unsigned long long) e->calls, e->total / 1e6,
+                e->self / 1e6, (unsigned long long) e->allocs,
+                (int)e->name.len, e->name.data);
     }
 
-    free(symbols.data);
-    freeList(env.stack);
+    free(sorted);
 }
 
-void verifyArg(List *stack, const char *name) {
-    if(stack == NULL) {
+// Execution trace, enabled by +trace or --trace. Each evaluated
+// token is stored as a fixed-size record in a ring buffer, which
+// is written to TRACE_FILE when a script dies with a stack trace.
+// lerl --decode-trace prints it.
+#define TRACE_EVENTS 4096
+#define TRACE_FILE "lerl.trace"
+#define TRACE_MAGIC "LERLTRC1"
+
+typedef struct TraceEvent {
+    uint32_t    word;   // ProfEntry id, 0 for literal values
+    uint32_t    depth;  // operand stack length
+    uint64_t    time;
+} TraceEvent;
+
+__thread bool        trace = false;
+__thread TraceEvent  traceRing[TRACE_EVENTS];
+__thread uint64_t    traceCount = 0;
+
+// bound, if given, caches the id, so linked bodies skip hashing.
+void traceToken (Symbol s, GlobalSlot *bound, size_t depth) {
+    uint32_t word = 0;
+    if(bound != NULL) {
+        if(bound->traceId == 0) bound->traceId = profEntry(s.word)->id;
+        word = bound->traceId;
+    } else if(s.type == SYMBOL) {
+        word = profEntry(s.word)->id;
+    }
+
+    traceRing[traceCount++ % TRACE_EVENTS] = (TraceEvent) {
+        .word = word,
+        .depth = depth,
+        .time = profClock()
+    };
+}
+
+// Layout: magic, word count, (id, len, name) per word, event
+// count, events oldest first. Integers are in host order.
+void traceDump (const char *path) {
+    FILE *out = fopen(path, "wb");
+    if(out == NULL) {
+        perror(path);
+        return;
+    }
+
+    fwrite(TRACE_MAGIC, 1, 8, out);
+    uint32_t words = profCount;
+    fwrite(&words, sizeof(words), 1, out);
+    for(uint i = 0; i < profCap; i++) {
+        ProfEntry *e = profEntries[i];
+        if(e == NULL) continue;
+
+        uint32_t hdr[2] = { e->id, e->name.len };
+        fwrite(hdr, sizeof(hdr), 1, out);
+        fwrite(e->name.data, 1, e->name.len, out);
+    }
+
+    uint64_t first = (traceCount > TRACE_EVENTS)
+                            ? traceCount - TRACE_EVENTS : 0;
+    uint32_t events = traceCount - first;
+    fwrite(&events, sizeof(events), 1, out);
+    for(uint64_t i = first; i < traceCount; i++)
+        fwrite(traceRing + i % TRACE_EVENTS, sizeof(TraceEvent), 1, out);
+
+    fclose(out);
+    fprintf(stderr, "last %u trace events written to %s\n", events, path);
+}
+
+void freeTraceNames (String *names, uint32_t words) {
+    if(names == NULL) return;
+    for(uint32_t i = 1; i <= words; i++)
+        free((char *) names[i].data);
+    free(names);
+}
+
+int traceDecode (const char *path) {
+    FILE *in = fopen(path, "rb");
+    if(in == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    char magic[8];
+    uint32_t words;
+    struct stat details;
+    if(fread(magic, 1, 8, in) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0
+       || fread(&words, sizeof(words), 1, in) != 1
+       || fstat(fileno(in), &details) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(in);
+        return 1;
+    }
+
+    // Each word takes its 8 byte header at least, so a count or
+    // name longer than the file is broken, not allocated.
+    uint64_t size = details.st_size;
+    String *names = NULL;
+    if(words > size / 8) goto broken;
+
+    names = calloc((size_t) words + 1, sizeof(String));
+    names[0] = constString("(value)");
+    for(uint32_t i = 0; i < words; i++) {
+        uint32_t hdr[2];
+        if(fread(hdr, sizeof(hdr), 1, in) != 1 || hdr[0] == 0
+           || hdr[0] > words || names[hdr[0]].data != NULL
+           || hdr[1] > size) goto broken;
+
+        char *name = malloc(hdr[1]);
+        names[hdr[0]] = (String) { .data = name, .len = hdr[1] };
+        if(fread(name, 1, hdr[1], in) != hdr[1]) goto broken;
+    }
+
+    uint32_t events;
+    if(fread(&events, sizeof(events), 1, in) != 1) goto broken;
+
+    uint64_t start = 0;
+    for(uint32_t i = 0; i < events; i++) {
+        TraceEvent ev;
+        if(fread(&ev, sizeof(ev), 1, in) != 1 || ev.word > words)
+            goto broken;
+        if(i == 0) start = ev.time;
+
+        printf("%12.3f us %6u  %.*s\n", (ev.time - start) / 1e3,
+               ev.depth, (int)names[ev.word].len, names[ev.word].data);
+    }
+
+    freeTraceNames(names, words);
+    fclose(in);
+    return 0;
+
+broken:
+    fprintf(stderr, "%s: truncated trace file\n", path);
+    freeTraceNames(names, words);
+    fclose(in);
+    return 1;
+}
+
+void callBuiltin (Symbol s, RunEnv *env) {
+    if(!prof) {
+        s.value.builtin(env);
+        return;
+    }
+
+    profEnter(s.word);
+    s.value.builtin(env);
+    profLeave();
+}
+
+void assignLocal (RunEnv *env, uint local);
+
+// link is the fn body cell of insym (see linkBody() and
+// linkLocals()) or NULL.
+void evalBound (Symbol insym, List *link, RunEnv *env) {
+    GlobalSlot *bound = (link != NULL) ? link->bound : NULL;
+    bool tail = takeTailPos(env);
+    if(trace) traceToken(insym, bound, env->stack.len);
+
+    if(dbg) {
+        writeConst(&errw, "eval: ");
+        printSymbol(&errw, insym);
+        if(env->stack.len > 0) {
+            writeChar(&errw, ' ');
+            printSymbol(&errw, *peek(env, 0));
+        }
+        writeChar(&errw, '\n');
+        flushWriter(&errw);
+    }
+
+    if(stringEq(insym.word, Nothing.word)) {
+        push(env, Nothing);
+        return;
+    }
+
+    if(insym.type != SYMBOL) {
+        push(env, refsym(insym));
+        return;
+    }
+
+    if(link != NULL && link->link == LINK_CONST) {
+        push(env, specialSym(insym));
+        return;
+    }
+
+    Symbol s = Nothing;
+    if(link != NULL && link->link != LINK_NONE && link->frame == env->frame) {
+        if(link->link == LINK_NAME) {
+            push(env, insym);
+            return;
+        }
+
+        if(link->link == LINK_STORE) {
+            if(prof) profEnter(insym.word);
+            assignLocal(env, link->local);
+            if(prof) profLeave();
+            return;
+        }
+
+        s = *frameSlot(env, link->local);
+    }
+
+    if(s.type != NOTHING)
+        ;
+    else if(bound != NULL && bound->owner == env->globals
+            && !__atomic_load_n(&bound->shadowed, __ATOMIC_RELAXED))
+        s = (bound->def != NULL) ? bound->def->val : Nothing;
+    else
+        s = findVar(env, insym.word);
+
+    if(s.type != NOTHING) {
+        if(s.type == BUILTIN) {
+            env->tailPos = tail;
+            callBuiltin(s, env);
+            env->tailPos = false;
+        } else if(s.type == FUNCTION) {
+            if(tail) evalTail(s, false, env);
+            else eval(s, env);
+        } else {
+            push(env, refsym(s));
+        }
+    } else {
+        push(env, specialSym(insym));
+    }
+
+    if(dbg && env->stack.len > 0) {
+        writeConst(&errw, " >> ");
+        printSymbol(&errw, *peek(env, 0));
+        writeChar(&errw, '\n');
+        flushWriter(&errw);
+    }
+}
+
+void evalSym (Symbol insym, RunEnv *env) {
+    evalBound(insym, NULL, env);
+}
+
+// Gives named body fresh slots for its locals.
+void enterFrame (Symbol body, RunEnv *env) {
+    List *head = body.value.list;
+    env->frame = (head != NULL) ? head->frame : NULL;
+    env->frameBase = env->locals.len;
+    if(env->frame == NULL) return;
+
+    stackReserve(&(env->locals), env->frame->count);
+    for(uint i = 0; i < env->frame->count; i++)
+        env->locals.data[env->locals.len++] = Nothing;
+}
+
+void leaveFrame (RunEnv *env) {
+    while(env->locals.len > env->frameBase)
+        dropSym(env->locals.data[--env->locals.len]);
+}
+
+void eval (Symbol body, RunEnv *env) {
+    Locals *callerFrame = env->frame;
+    size_t callerBase = env->frameBase;
+    bool framed = body.word.len > 0;
+    if(framed) enterFrame(body, env);
+
+    env->scopeStack = cons((Symbol) {
+                             .word = (body.word.len > 0)
+                                                ?body.word
+                                                :constString("(eval)"),
+                             .type = SCOPE,
+                             .value.list = (body.word.len > 0)
+                                                ?NULL
+                                                :env->scopeStack->val.value.list },
+                            env->scopeStack);
+
+    // Frame of the named fn currently running in this loop.
+    bool profiled = prof && body.word.len > 0;
+    if(profiled) profEnter(body.word);
+
+    bool owned = false;
+    while(true) {
+        for(List *cur = body.value.list; cur != NULL; cur = cur->next) {
+            env->tailPos = (cur->next == NULL);
+            evalBound(cur->val, cur, env);
+        }
+
+        if(!env->hasTail) break;
+
+        Symbol next = env->tail;
+        bool nextOwned = env->tailOwned;
+        env->hasTail = false;
+
+        if(owned) freeList(body.value.list);
+
+        // Function gets a fresh scope, anonymous body would share
+        // ours, and there is nothing left to do in this frame
+        // after it, so it can just run here.
+        if(next.word.len > 0) {
+            if(profiled) profLeave();
+            profiled = prof;
+            if(profiled) profEnter(next.word);
+
+            popScope(env);
+            env->scopeStack = cons((Symbol) {
+                                     .word = next.word,
+                                     .type = SCOPE,
+                                     .value.list = NULL },
+                                   env->scopeStack);
+
+            if(framed) leaveFrame(env);
+            framed = true;
+            enterFrame(next, env);
+        }
+
+        body = next;
+        owned = nextOwned;
+    }
+
+    if(owned) freeList(body.value.list);
+    if(profiled) profLeave();
+    popScope(env);
+
+    if(framed) leaveFrame(env);
+    env->frame = callerFrame;
+    env->frameBase = callerBase;
+}
+
+// Evaluates tokens of root one by one, as they are read.
+void runTokens(Source root, RunEnv *env) {
+    TokenStream tokens = { .src = root, .pos = 0 };
+    String current;
+
+    while(nextToken(&tokens, &current)) {
+        if(trace) {
+            traceToken((Symbol) { .word = current, .type = SYMBOL },
+                       NULL, env->stack.len);
+        }
+
+        if(stringEq(current, Nothing.word)) {
+            push(env, Nothing);
+            continue;
+        }
+        
+        Symbol val = findVar(env, current);
+
+        if(val.type == BUILTIN) {
+            callBuiltin(val, env);
+        } else if (val.type == FUNCTION) {
+            eval(val, env);
+        } else if (val.type == NOTHING) {
+            push(env, specialSym((Symbol){
+                                    .word = current,
+                                    .type = SYMBOL,
+                                    .value.string = current}));
+        } else {
+            push(env, refsym(val));
+        }
+    }
+}
+
+void run_source(Source root, SymTab *globals) {
+    RunEnv env = { .stack = { .data = NULL },
+                   .globals = globals,
+                   .scopeStack = consList(NULL, NULL) };
+
+    runTokens(root, &env);
+
+    if(env.stack.len > 0) {
+        writeChar(&outw, '\n');
+        printStack(&outw, &env);
+        writeChar(&outw, '\n');
+    }
+
+    while(env.stack.len > 0)
+        dropSym(popStack(&env));
+    free(env.stack.data);
+    free(env.locals.data);
+}
+
+void verifyArg(RunEnv *env, const char *name) {
+    if(env->stack.len == 0) {
         fprintf(stderr, "ERROR: syntax error %s\n", name);
-        exit(1);
+        fail(1);
     }
 }
 
-typedef struct Converter {
-    int srcType, dstType;
-    Symbol (*act)(Symbol src, List **sidestack);
-} Converter;
+typedef Symbol (*Converter)(Symbol src, List **sidestack);
 
 Symbol conv_Source_String(Symbol src, List **sidestack) {
     Source val = src.value.source;
@@ -1005,80 +2758,150 @@ Symbol conv_char_int (Symbol src, List **sidestack) {
     };
 }
 
-Converter converters[] = (Converter[]) {
-    {.srcType = SOURCE,
-     .dstType = STRING,
-     .act = &conv_Source_String},
-    {.srcType = CHAR,
-     .dstType = INT,
-     .act = &conv_char_int}
+// converters[from][to], NULL where there is no conversion.
+Converter converters[ANY+1][ANY+1] = {
+    [SOURCE][STRING] = &conv_Source_String,
+    [CHAR][INT]      = &conv_char_int
 };
-        
-Converter *findConverter(int from, int to) {
-    for(uint i = 0;
-        i < sizeof(converters)/sizeof(Converter);
-        i++) {
-        if(from == converters[i].srcType
-           && to == converters[i].dstType){
-            return converters+i;
-        }
-    }
 
-    return NULL;
+// Argument types of a builtin, top of the stack first.
+#define MAX_ARGS 3
+
+typedef struct Signature {
+    uint    count;
+    int     types[MAX_ARGS];
+} Signature;
+
+bool argMatches (int type, int want) {
+    return want == ANY || type == want || converters[type][want] != NULL;
 }
 
-List *getArgs(RunEnv *env, uint count, int types[]) {
-    if(&(env->stack) == NULL || env->stack == NULL) {
-        return NULL;
-    }
+// Converts and takes count symbols from the top of the stack,
+// which must match types. Returned slice has the former top
+// at index 0 and is left in unused part of the stack, so it stays
+// valid only until the next push.
+Symbol *takeArgs(RunEnv *env, uint count, const int types[]) {
+    Stack *st = &(env->stack);
 
-    Converter *convs[count];
+    List *sidestack = NULL;
+    uint sidelen = 0;
     for(uint i = 0; i < count; i++) {
-        convs[i] = 0;
+        Symbol *cur = st->data + st->len - 1 - i;
+        int want = types[i];
+        if(want != ANY && cur->type != want)
+            *cur = converters[cur->type][want](*cur, &sidestack);
+    }
+    for(List *cur = sidestack; cur != NULL; cur = cur->next)
+        sidelen++;
+
+    st->len -= count;
+    Symbol *args = st->data + st->len;
+    for(uint i = 0; i < count / 2; i++) {
+        Symbol tmp = args[i];
+        args[i] = args[count - 1 - i];
+        args[count - 1 - i] = tmp;
     }
 
-    List *cur = env->stack;
-    for(uint i = 0; i < count; i++) {
-        if(cur == NULL) return NULL;
+    // What converters leave aside stays on the stack, below
+    // what builtin will push, so the slice moves up.
+    if(sidestack != NULL) {
+        stackReserve(st, sidelen + count);
+        args = st->data + st->len;
+        memmove(args + sidelen, args, count * sizeof(Symbol));
+
+        sidestack = reverseList(sidestack);
+        while(sidestack != NULL) {
+            List *cur = sidestack;
+            sidestack = cur->next;
+            st->data[st->len++] = cur->val;
+            freeCell(cur);
+        }
+        args = st->data + st->len;
+    }
 
-        if(types[i] != ANY
-            && cur->val.type != types[i]
-            && (convs[i] = findConverter(cur->val.type, types[i])) == NULL) {
-            return NULL;
+    return args;
+}
+
+// Picks the first of sigs matched by the top of the stack, in a
+// single walk down the stack, and takes its args into *args.
+// Returns its index, or -1 with *args set to NULL.
+int getOverload(RunEnv *env, uint nsigs, const Signature sigs[],
+                Symbol **args) {
+    Stack *st = &(env->stack);
+    uint viable = 0, depth = 0;
+
+    for(uint k = 0; k < nsigs; k++) {
+        if(sigs[k].count > 0 && sigs[k].count <= st->len) {
+            viable |= 1u << k;
+            if(sigs[k].count > depth) depth = sigs[k].count;
         }
-        cur = cur->next;
     }
 
-    List *sidestack = NULL;
-    if(convs[0] != NULL) {
-        (env->stack)->val = convs[0]->act((env->stack)->val, &sidestack);
+    for(uint i = 0; i < depth && viable != 0; i++) {
+        int type = st->data[st->len - 1 - i].type;
+        for(uint k = 0; k < nsigs; k++) {
+            if((viable & (1u << k)) && i < sigs[k].count
+               && !argMatches(type, sigs[k].types[i]))
+                viable &= ~(1u << k);
+        }
     }
 
-    cur = env->stack;
-    for(uint i = 1; i < count; i++) {
-        cur = cur->next;
-        if(convs[i] != NULL) {
-            cur->val = convs[i]->act(cur->val, &sidestack);
+    for(uint k = 0; k < nsigs; k++) {
+        if(viable & (1u << k)) {
+            *args = takeArgs(env, sigs[k].count, sigs[k].types);
+            return k;
         }
     }
 
-    List *args = env->stack;
-    env->stack = cur->next;
+    *args = NULL;
+    return -1;
+}
+
+#define overload(ENV, SIGS, ARGS) \
+    getOverload(ENV, sizeof(SIGS)/sizeof(Signature), SIGS, ARGS)
 
-    if(sidestack != NULL) {
-        List *cur = sidestack;
-        for(; cur->next != NULL; cur = cur->next);
-        cur->next = env->stack;
-        env->stack = sidestack;
+// Checks (converting if needed) and takes count symbols from the
+// top of the stack, see takeArgs().
+Symbol *getArgs(RunEnv *env, uint count, int types[]) {
+    Stack *st = &(env->stack);
+    if(count == 0 || st->len < count) {
+        return NULL;
     }
 
-    return args;
+    for(uint i = 0; i < count; i++) {
+        if(!argMatches(st->data[st->len - 1 - i].type, types[i]))
+            return NULL;
+    }
+
+    return takeArgs(env, count, types);
+}
+
+// Runs self with sym alone on a fresh stack and returns the top
+// of what it leaves.
+Symbol mapOne(RunEnv *env, void (*self) (RunEnv *), Symbol sym) {
+    RunEnv inenv = {.stack = { .data = NULL },
+                    .globals = env->globals,
+                    .scopeStack = env->scopeStack,
+                    .inPmap = env->inPmap };
+    push(&inenv, sym);
+    self(&inenv);
+
+    Symbol ans = popStack(&inenv);
+    while(inenv.stack.len > 0)
+        dropSym(popStack(&inenv));
+    free(inenv.stack.data);
+
+    return ans;
 }
 
+// Applies self to every element of LIST or ARRAY from the top
+// of the stack, each on its own stack, and collects the results.
 Symbol implicitMap(RunEnv *env, void (*self) (RunEnv *)) {
-    Symbol s = pop(&(env->stack)); 
+    Symbol s = popStack(env);
+    List *ans = NULL;
+    List **wcur = &ans;
+
     if(s.type == ARRAY) {
-        List *ans = NULL;
         StringArray arr = s.value.array;
         for(uint i = 0; i < arr.len; i++) {
             Symbol sym = (Symbol) {
@@ -1086,66 +2909,93 @@ Symbol implicitMap(RunEnv *env, void (*self) (RunEnv *)) {
                             .type = SYMBOL,
                             .value.string = arr.data[i]
                          };
-            ans = cons(sym, ans);
-            RunEnv inenv = {.stack = ans,
-                            .globals = env->globals,
-                            .scopeStack = env->scopeStack };
-            self(&inenv);
-
-            free_StringArray(s.value.array);
-        }
-        return (Symbol) {
-                 .word=constString(""),
-                 .type=LIST,
-                 .value.list=ans};
+            *wcur = cons(mapOne(env, self, sym), NULL);
+            wcur = &((*wcur)->next);
+        }
+        free_StringArray(arr);
     } else if(s.type == LIST) {
-        List *ans = NULL;
         for(List *cur = s.value.list; cur != NULL; cur=cur->next) {
-            ans = cons(cur->val, ans);
-            RunEnv inenv = {.stack = ans,
-                            .globals = env->globals,
-                            .scopeStack = env->scopeStack};
-            self(&inenv);
-        }
-        return (Symbol) {
-                 .word=constString(""),
-                 .type=LIST,
-                 .value.list=ans};
+            *wcur = cons(mapOne(env, self, refsym(cur->val)), NULL);
+            wcur = &((*wcur)->next);
+        }
+        freeList(s.value.list);
     } else
         return s;
+
+    return (Symbol) {
+             .word=constString(""),
+             .type=LIST,
+             .value.list=ans};
 }
 
-void printSymbols (FILE *out, List* lst) {
+void printSymbols (Writer *out, List* lst) {
     for(List *vcur = lst; vcur != NULL; vcur = vcur->next) {
-        fprintf(out, "%.*s = ", (int)vcur->val.word.len, vcur->val.word.data);
+        writeStr(out, vcur->val.word);
+        writeConst(out, " = ");
         printSymbol(out, vcur->val);
-        fprintf(out, " ");
+        writeChar(out, ' ');
     }
 }
 
-void printStackTrace (FILE *out, RunEnv *env) {
-    fprintf(out, "Stack trace:\n");
-    uint i = 0;
+void printStackTrace (Writer *out, RunEnv *env) {
+    if(trace) traceDump(TRACE_FILE);
+
+    writeConst(out, "Stack trace:\n");
+    int i = 0;
     for(List *cur = env->scopeStack; cur != NULL; cur = cur->next) {
-        fprintf(out, "    %u: %.*s\n      * vars: ", i++, (int)cur->val.word.len, cur->val.word.data);
+        writeConst(out, "    ");
+        writeInt(out, i++);
+        writeConst(out, ": ");
+        writeStr(out, cur->val.word);
+        writeConst(out, "\n      * vars: ");
         printSymbols(out, cur->val.value.list);
-        fprintf(out, "\n");
+        writeChar(out, '\n');
+    }
+
+    if(env->frame != NULL) {
+        writeConst(out, "\nLocals: ");
+        for(uint i = 0; i < env->frame->count; i++) {
+            writeStr(out, env->frame->names[i]);
+            writeConst(out, " = ");
+            printSymbol(out, *frameSlot(env, i));
+            writeChar(out, ' ');
+        }
+        writeChar(out, '\n');
     }
 
-    fprintf(out, "\nCurrent stack: ");
-    printSymbols(out, env->stack);
-    fprintf(out, "\n");
+    writeConst(out, "\nCurrent stack: ");
+    for(size_t i = env->stack.len; i > 0; i--) {
+        Symbol s = env->stack.data[i-1];
+        writeStr(out, s.word);
+        writeConst(out, " = ");
+        printSymbol(out, s);
+        writeChar(out, ' ');
+    }
+    writeChar(out, '\n');
+    flushWriter(out);
 }
 
 #define argsOrWarn(ARGS) \
     if(ARGS == NULL) { \
         fprintf(stderr, "%s: wrong argument list\n", \
                 __FUNCTION__); \
-        printStackTrace(stderr, env); \
-        exit(1); \
+        printStackTrace(&errw, env); \
+        fail(1); \
         return; \
     }
 
+bool symbolEq (Symbol a, Symbol b);
+
+bool listEq (List *a, List *b) {
+    for(; a != NULL && b != NULL; a = a->next, b = b->next) {
+        if(!symbolEq(a->val, b->val)) return false;
+    }
+
+    return a == NULL && b == NULL;
+}
+
+// Lists, arrays, vectors and deques compare by content, builders,
+// streams and sources are the same only if they are one value.
 bool symbolEq (Symbol a, Symbol b) {
     if(a.type != b.type) return false;
     if(a.type == INT) {
@@ -1158,41 +3008,89 @@ bool symbolEq (Symbol a, Symbol b) {
         return stringEq(a.word, b.word);
     } else if (a.type == NOTHING) {
         return true;
+    } else if (a.type == BOOLEAN) {
+        return a.value.boolean == b.value.boolean;
+    } else if (a.type == LIST) {
+        return listEq(a.value.list, b.value.list);
+    } else if (a.type == FUNCTION) {
+        return a.value.list == b.value.list;
+    } else if (a.type == BUILTIN) {
+        return a.value.builtin == b.value.builtin;
+    } else if (a.type == ARRAY) {
+        if(a.value.array.len != b.value.array.len) return false;
+        for(size_t i = 0; i < a.value.array.len; i++) {
+            if(!stringEq(a.value.array.data[i], b.value.array.data[i]))
+                return false;
+        }
+        return true;
+    } else if (a.type == VECTOR) {
+        Vector *va = a.value.vector, *vb = b.value.vector;
+        if(va->len != vb->len) return false;
+        for(size_t i = 0; i < va->len; i++) {
+            if(!symbolEq(va->data[i], vb->data[i])) return false;
+        }
+        return true;
+    } else if (a.type == DEQUE) {
+        Deque *da = a.value.deque, *db = b.value.deque;
+        if(da->len != db->len) return false;
+        for(size_t i = 0; i < da->len; i++) {
+            if(!symbolEq(*dequeAt(da, i), *dequeAt(db, i))) return false;
+        }
+        return true;
+    } else if (a.type == BUILDER) {
+        return a.value.builder == b.value.builder;
+    } else if (a.type == STREAM) {
+        return a.value.stream == b.value.stream;
+    } else if (a.type == SOURCE) {
+        return a.value.source.buff == b.value.source.buff;
     } else {
-        fprintf(stderr, "TODO: symbolEq for type %d.\n", a.type);
-        return false;
+        fprintf(stderr, "Can't compare values of type %d.\n", a.type);
+        fail(1);
+    }
+}
+
+// Variable visible to inject: a local of the running frame or
+// one bound in the top scope (vars up to the parent's ones), no
+// globals. Nothing if there is none.
+Symbol injectedVar(RunEnv *env, String name) {
+    if(env->frame != NULL) {
+        int local = localIndex(env->frame, name);
+        if(local >= 0 && frameSlot(env, local)->type != NOTHING)
+            return *frameSlot(env, local);
+    }
+
+    List *vars = env->scopeStack->val.value.list;
+    List *varlim = outerVars(env);
+    for(List *cur = vars; cur != varlim && cur != NULL; cur = cur->next) {
+        if(stringEq(cur->val.word, name))
+            return cur->val;
     }
+
+    return Nothing;
 }
 
 // rewriteList and inject are copying and in-place variants
-// of inject builtin. They work on tgt list, they look for
-// symbols in vars-varlim list part (used for top-scope
-// variables, no globals). If they find any, they are
-// replaced with found values.
-List *rewriteList(List *tgt, List *vars, List *varlim) {
+// of inject builtin. They work on tgt list, symbols found by
+// injectedVar() are replaced with their values.
+List *rewriteList(List *tgt, RunEnv *env) {
     if(tgt == NULL) return NULL;
 
     List *ans = NULL;
     List **wcur = &ans;
     for(List *cur = tgt; cur != NULL; cur = cur->next) {
         if(cur->val.type == LIST) {
-            *wcur = consList(NULL, rewriteList(cur->val.value.list, vars, varlim));
+            *wcur = consList(NULL, rewriteList(cur->val.value.list, env));
         } else if (cur->val.type != SYMBOL) {
             if(cur->val.type == ARRAY)
-                cur->val.value.array.refs++;
+                refInc(&cur->val.value.array.refs);
 
-            *wcur = cons(cur->val, NULL);
+            *wcur = cons(refsym(cur->val), NULL);
         } else {
-            List *varc;
-            for(varc = vars; varc != varlim && varc != NULL; varc = varc->next) {
-                if(stringEq(varc->val.word, cur->val.word))
-                    break;
-            }
-
-            if(varc == varlim || varc == NULL)
+            Symbol var = injectedVar(env, cur->val.word);
+            if(var.type == NOTHING)
                 *wcur = cons(cur->val, NULL);
             else
-                *wcur = cons(varc->val, NULL);
+                *wcur = cons(refsym(var), NULL);
         }
         wcur = &((*wcur)->next);
     }
@@ -1200,21 +3098,17 @@ List *rewriteList(List *tgt, List *vars, List *varlim) {
     return ans;
 }
 
-List *inject(List *tgt, List *vars, List *varlim) {
+List *inject(List *tgt, RunEnv *env) {
     for(List *cur = tgt; cur != NULL; cur = cur->next) {
         Symbol sym = cur->val;
         if(sym.type == LIST) {
-            cur->val.value.list = inject(sym.value.list, vars, varlim);
+            cur->val.value.list = inject(sym.value.list, env);
         } else if(sym.type == SYMBOL) {
-            List *vcur;
-            for(vcur = vars; vcur != varlim && vcur != NULL; vcur = vcur->next) {
-                if(stringEq(vcur->val.word, sym.word)) {
-                    break;
-                }
-            }
-
-            if(vcur != varlim && vcur != NULL) {
-                cur->val = vcur->val;
+            Symbol var = injectedVar(env, sym.word);
+            if(var.type != NOTHING) {
+                cur->val = refsym(var);
+                cur->bound = NULL;
+                cur->link = LINK_NONE;
             }
         }
     }
@@ -1224,33 +3118,42 @@ List *inject(List *tgt, List *vars, List *varlim) {
 
 void wrong_schema_error(List *schema, List *source) {
     fprintf(stderr, "not matching schema:\n  source:");
-    printList(stderr, source);
+    printList(&errw, source);
     fprintf(stderr, "\n  schema:");
-    printList(stderr, schema);
+    printList(&errw, schema);
     fprintf(stderr, "\n");
 
-    exit(1);
+    fail(1);
 }
 
 void extract(List *source, List *schema, RunEnv *env) {
-    List **vars =  &(env->scopeStack->val.value.list);
     while(source != NULL || schema != NULL) {
         if(source != NULL && schema != NULL) {
             if(schema->val.type == LIST) {
                 if(source->val.type != LIST) {
-                    printf("-- %d %d ---\n", source->val.type, schema->val.type);
+                    writeConst(&outw, "-- ");
+                    writeInt(&outw, source->val.type);
+                    writeChar(&outw, ' ');
+                    writeInt(&outw, schema->val.type);
+                    writeConst(&outw, " ---\n");
                     wrong_schema_error(schema, source);
                 } else {
                     extract(source->val.value.list,
                             schema->val.value.list,
                             env);
                 }
+            } else if(schema->link == LINK_NAME
+                      && schema->frame == env->frame) {
+                Symbol *slot = frameSlot(env, schema->local);
+                dropSym(*slot);
+                *slot = refsym((Symbol) {
+                            .word = schema->val.word,
+                            .type = source->val.type,
+                            .value = source->val.value,
+                            .text = source->val.text
+                        });
             } else {
-                *vars = cons((Symbol) {
-                                .word = schema->val.word,
-                                .type = source->val.type,
-                                .value = source->val.value
-                            }, *vars);
+                bindVar(env, schema->val.word, refsym(source->val));
             }
         } else
             wrong_schema_error(schema, source);
@@ -1261,376 +3164,588 @@ void extract(List *source, List *schema, RunEnv *env) {
 }
 
 void builtin_cons (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) {ANY, LIST});
+    static const Signature sigs[] = {
+        { 2, { ANY, LIST } },
+        { 2, { ANY, DEQUE } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
     argsOrWarn(args);
 
-    Symbol consee = pop(&args);
-    List **lst = &(args->val.value.list);
+    if(sig == 1) {
+        Symbol dq = args[1];
+        dequePushFront(dq.value.deque, args[0]);
+        push(env, dq);
+        return;
+    }
+
+    Symbol consee = args[0];
+    Symbol lst = args[1];
 
-    *lst = cons(consee, *lst);
-    env->stack = args;
+    lst.value.list = cons(consee, lst.value.list);
+    push(env, lst);
 }
 
 void builtin_extract (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { LIST, LIST });
+    Symbol *args = getArgs(env, 2, (int[]) { LIST, LIST });
     argsOrWarn(args);
 
-    List *schema = pop(&args).value.list;
-    List *source = pop(&args).value.list;
+    List *schema = args[0].value.list;
+    List *source = args[1].value.list;
 
     extract(source, schema, env);
 }
 
 void builtin_inject (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]) { LIST });
+    Symbol *args = getArgs(env, 1, (int[]) { LIST });
     argsOrWarn(args);
 
-    List *lst = pop(&args).value.list;
-    List *vars = env->scopeStack->val.value.list;
-    List *varlim = (env->scopeStack->next)
-                        ?env->scopeStack->next->val.value.list
-                        :NULL;
+    List *lst = args[0].value.list;
 
     List *ans = NULL;
-    if(lst->refs > 1) {
-        ans = rewriteList(lst, vars, varlim);
-        lst->refs--;
+    if(refCount(&lst->refs) > 1) {
+        ans = rewriteList(lst, env);
+        refDec(&lst->refs);
     } else {
-        ans = inject(lst, vars, varlim);    
+        ans = inject(lst, env);    
     }
-    env->stack = consList(env->stack, ans);
+    pushList(env, ans);
 }
 
 void builtin_isEmpty (RunEnv *env) {
-    if(env->stack == NULL || env->stack->val.type != LIST) {
+    Symbol *top = peek(env, 0);
+    if(top != NULL && top->type == VECTOR) {
+        pushBool(env, top->value.vector->len == 0);
+        return;
+    }
+
+    if(top != NULL && top->type == DEQUE) {
+        pushBool(env, top->value.deque->len == 0);
+        return;
+    }
+
+    if(top == NULL || top->type != LIST) {
         fprintf(stderr, "builtin_empty?: wrong arg\n");
         return;
     }
 
-    env->stack = consBool(env->stack->val.value.list == NULL, env->stack);
+    pushBool(env, top->value.list == NULL);
 }
+void builtin_popLast (RunEnv *env) {
+    Symbol *top = peek(env, 0);
+    if(top != NULL && top->type == DEQUE) {
+        Deque *d = top->value.deque;
+        push(env, (d->len > 0) ? dequePopBack(d) : Nothing);
+        return;
+    }
+
+    if(top != NULL && top->type == VECTOR) {
+        builtin_pop(env);
+        return;
+    }
+
+    fprintf(stderr, "builtin_popLast: wrong arg\n");
+    printStackTrace(&errw, env);
+    fail(1);
+}
+
+// Vectors are popped at the end, deques at the front.
 void builtin_pop (RunEnv *env) {
-    if(env->stack == NULL || env->stack->val.type != LIST) {
+    Symbol *top = peek(env, 0);
+    if(top != NULL && top->type == VECTOR) {
+        Vector *v = top->value.vector;
+        push(env, (v->len > 0) ? v->data[--v->len] : Nothing);
+        return;
+    }
+
+    if(top != NULL && top->type == DEQUE) {
+        Deque *d = top->value.deque;
+        push(env, (d->len > 0) ? dequePopFront(d) : Nothing);
+        return;
+    }
+
+    if(top == NULL || top->type != LIST) {
         fprintf(stderr, "builtin_pop: wrong arg\n");
-        printStackTrace(stderr, env);
-        exit(1);
+        printStackTrace(&errw, env);
+        fail(1);
     }
 
-    List **lptr = &(env->stack->val.value.list);
+    List **lptr = &(top->value.list);
     if(*lptr == NULL) {
-        env->stack = cons(Nothing, env->stack);
+        push(env, Nothing);
         return;
     }
 
-    if((*lptr)->refs == 1) {
-        List *tail = (*lptr)->next;
-        (*lptr)->next = env->stack;
-        env->stack = *lptr;
-        *lptr = tail;
+    Symbol val;
+    if(refCount(&(*lptr)->refs) == 1) {
+        List *head = *lptr;
+        *lptr = head->next;
+        val = head->val;
+        freeCell(head);
     } else {
-        env->stack = cons(pop(lptr), env->stack);
+        val = refsym(pop(lptr));
     }
+
+    push(env, val);
 }
 
 void builtin_lst (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]){ INT });
+    Symbol *args = getArgs(env, 1, (int[]){ INT });
     argsOrWarn(args);
 
-    int n = pop(&args).value.integer;
-    List *cur = env->stack;
-    for(uint i = 1; i < n && cur != NULL; i++, cur = cur->next);
-    if(cur == NULL) {
+    int n = args[0].value.integer;
+    size_t count = (n > 1) ? n : 1;
+    if(count > env->stack.len) {
         fprintf(stderr, "builtin_lst: insufficient args.\n");
         return;
     }
 
-    List *newstack = cur->next;
-    cur->next = NULL;
-    env->stack = consList(newstack, env->stack);
+    List *lst = stackSlice(env, env->stack.len - count);
+    pushList(env, reverseList(lst));
 }
 
 void builtin_toInt (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]){ STRING });
+    Symbol *args = getArgs(env, 1, (int[]){ STRING });
     argsOrWarn(args);
 
-    env->stack = cons(strToInt(pop(&args).value.string), env->stack);
+    Symbol str = args[0];
+    Symbol num = strToInt(str.value.string);
+    num.word = constString("");
+    dropSym(str);
+    push(env, num);
 }
 
 void builtin_toSym (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]){ STRING });
+    Symbol *args = getArgs(env, 1, (int[]){ STRING });
     argsOrWarn(args);
 
-    String str = pop(&args).value.string;
-    env->stack = cons ((Symbol) { .word = str,
-                              .type = SYMBOL,
-                              .value.string = str},
-                   env->stack);
+    String str = args[0].value.string;
+    push(env, (Symbol) { .word = str,
+                         .type = SYMBOL,
+                         .value.string = str,
+                         .text = args[0].text });
 }
 
 void builtin_toStr (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]){ SYMBOL });
+    static const Signature sigs[] = {
+        { 1, { SYMBOL } },
+        { 1, { BUILDER } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
     argsOrWarn(args);
 
-    Symbol sym = pop(&args);
+    if(sig == 1) {
+        Builder *b = args[0].value.builder;
+        push(env, textSymbol(b->data, b->len));
+        releaseBuilder(b);
+        return;
+    }
+
+    Symbol sym = args[0];
     sym.type = STRING;
 
-    env->stack = cons (sym, env->stack);
+    push(env, sym);
 }
 
-void builtin_eval (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]){ LIST });
+void builtin_builder (RunEnv *env) {
+    push(env, (Symbol) {
+                .word = constString(""),
+                .type = BUILDER,
+                .value.builder = mkBuilder() });
+}
+
+// Appends STRING, SYMBOL, CHAR or INT on top to the builder
+// below it, leaving the builder.
+void builtin_appendText (RunEnv *env) {
+    Symbol *args = getArgs(env, 2, (int[]){ ANY, BUILDER });
     argsOrWarn(args);
 
-    Symbol sym = pop(&args);
-    eval(sym, env);
-    freeList(sym.value.list);
+    Symbol val = args[0];
+    Symbol b = args[1];
+    push(env, b);
+
+    if(val.type == STRING || val.type == SYMBOL) {
+        builderAppend(b.value.builder, val.value.string.data,
+                      val.value.string.len);
+        dropSym(val);
+    } else if(val.type == CHAR) {
+        builderAppend(b.value.builder, &(val.value.character), 1);
+    } else if(val.type == INT) {
+        char digits[INT_DIGITS];
+        uint i = formatInt(digits, val.value.integer);
+        builderAppend(b.value.builder, digits + i, INT_DIGITS - i);
+    } else if(val.type == BUILDER) {
+        builderAppend(b.value.builder, val.value.builder->data,
+                      val.value.builder->len);
+        releaseBuilder(val.value.builder);
+    } else {
+        fprintf(stderr, "builtin_appendText: can't append type %d\n",
+                val.type);
+        printStackTrace(&errw, env);
+        fail(1);
+    }
 }
 
-void builtin_dbgon (RunEnv *env) {
-    dbg = true;
+void builtin_deque (RunEnv *env) {
+    push(env, (Symbol) {
+                .word = constString(""),
+                .type = DEQUE,
+                .value.deque = mkDeque() });
 }
 
-void builtin_dbgoff (RunEnv *env) {
+void builtin_toVec (RunEnv *env) {
+    Symbol *args = getArgs(env, 1, (int[]){ LIST });
+    argsOrWarn(args);
+
+    List *lst = args[0].value.list;
+    Vector *v = mkVector();
+    for(List *cur = lst; cur != NULL; cur = cur->next)
+        vectorPush(v, refsym(cur->val));
+    freeList(lst);
+
+    push(env, (Symbol) {
+                .word = constString(""),
+                .type = VECTOR,
+                .value.vector = v });
+}
+
+void builtin_toLst (RunEnv *env) {
+    static const Signature sigs[] = {
+        { 1, { VECTOR } },
+        { 1, { DEQUE } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    argsOrWarn(args);
+
+    if(sig == 1) {
+        Deque *d = args[0].value.deque;
+        List *ans = NULL;
+        for(size_t i = d->len; i > 0; i--)
+            ans = cons(refsym(*dequeAt(d, i-1)), ans);
+        releaseDeque(d);
+
+        pushList(env, ans);
+        return;
+    }
+
+    Vector *v = args[0].value.vector;
+    List *ans = NULL;
+    for(size_t i = v->len; i > 0; i--)
+        ans = cons(refsym(v->data[i-1]), ans);
+    releaseVector(v);
+
+    pushList(env, ans);
+}
+
+void builtin_eval (RunEnv *env) {
+    bool tail = takeTailPos(env);
+    Symbol *args = getArgs(env, 1, (int[]){ LIST });
+    argsOrWarn(args);
+
+    Symbol sym = args[0];
+    if(tail) {
+        evalTail(sym, true, env);
+        return;
+    }
+
+    eval(sym, env);
+    freeList(sym.value.list);
+}
+
+void builtin_traceon (RunEnv *env) {
+    trace = true;
+}
+
+void builtin_traceoff (RunEnv *env) {
+    trace = false;
+}
+
+void builtin_profon (RunEnv *env) {
+    prof = true;
+}
+
+void builtin_profoff (RunEnv *env) {
+    prof = false;
+}
+
+void builtin_dbgon (RunEnv *env) {
+    dbg = true;
+}
+
+void builtin_dbgoff (RunEnv *env) {
     dbg = false;
     fprintf(stderr, "Stack:\n");
-    printList(stderr, env->stack);
+    printStack(&errw, env);
     fprintf(stderr, "\n*************\n");
 }
 
 void builtin_exit (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]) { INT });
+    Symbol *args = getArgs(env, 1, (int[]) { INT });
     argsOrWarn(args);
 
-    int exitCode = pop(&args).value.integer;
-    exit(exitCode);
+    int exitCode = args[0].value.integer;
+    fail(exitCode);
 }
 
 void builtin_in (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { LIST, ANY });
+    Symbol *args = getArgs(env, 2, (int[]) { LIST, ANY });
     argsOrWarn(args);
 
-    List *options = pop(&args).value.list;
-    Symbol ref = pop(&args);
+    List *options = args[0].value.list;
+    Symbol ref = args[1];
+    push(env, ref);
 
     for(List *opt = options; opt != NULL; opt = opt->next) {
         Symbol sym = findVar(env, opt->val.word);
         if(sym.type == NOTHING) sym = opt->val;
 
         if(symbolEq(sym, ref)) {
-            env->stack = consBool(true,
-                              cons(ref, env->stack));
+            pushBool(env, true);
             freeList(options);
             return;
         }
     }
 
     freeList(options);
-    env->stack = consBool(false,
-                      cons(ref, env->stack));
+    pushBool(env, false);
 }
 
 void builtin_or (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]) { LIST });
-    if(args != NULL) {
-        List *tests = pop(&args).value.list;
-        List *bools = NULL;
+    static const Signature sigs[] = {
+        { 1, { LIST } },
+        { 2, { BOOLEAN, BOOLEAN } }
+    };
 
-        for(List *cur = tests; cur != NULL; cur = cur->next) {
-            evalSym(cur->val, env);
-            if(env->stack != NULL && env->stack->val.type == BOOLEAN) {
-                List *stacktail = env->stack->next;
-                env->stack->next = bools;
-                bools = env->stack;
-                env->stack = stacktail;
-            }
-        }
+    takeTailPos(env);
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    argsOrWarn(args);
 
-        freeList(tests);
+    if(sig == 0) {
+        List *tests = args[0].value.list;
+        bool ans = false;
 
-        while(bools != NULL) {
-            if(pop(&bools).value.boolean == true) {
-                freeList(bools);
-                env->stack = consBool(true, env->stack);
-                return;
+        for(List *cur = tests; cur != NULL; cur = cur->next) {
+            evalBound(cur->val, cur, env);
+            Symbol *top = peek(env, 0);
+            if(top != NULL && top->type == BOOLEAN) {
+                ans |= popStack(env).value.boolean;
             }
         }
 
-        env->stack = consBool(false, env->stack);
+        freeList(tests);
+        pushBool(env, ans);
 
         return;
     }
-    args = getArgs(env,  2, (int[]) { BOOLEAN, BOOLEAN });
-    argsOrWarn(args);
 
-    bool a = pop(&args).value.boolean;
-    bool b = pop(&args).value.boolean;
+    bool a = args[0].value.boolean;
+    bool b = args[1].value.boolean;
 
-    env->stack = consBool(a || b, env->stack);
+    pushBool(env, a || b);
 }
 
 void builtin_not (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]) { BOOLEAN });
+    Symbol *args = getArgs(env, 1, (int[]) { BOOLEAN });
     argsOrWarn(args);
-    env->stack = consBool(!(pop(&args).value.boolean), env->stack);
+    pushBool(env, !(args[0].value.boolean));
 }
 
 void builtin_and (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]) { LIST });
-    if(args != NULL) {
-        List *tests = pop(&args).value.list;
-        List *bools = NULL;
+    static const Signature sigs[] = {
+        { 1, { LIST } },
+        { 2, { BOOLEAN, BOOLEAN } }
+    };
 
-        for(List *cur = tests; cur != NULL; cur = cur->next) {
-            evalSym(cur->val, env);
-            if(env->stack != NULL && env->stack->val.type == BOOLEAN) {
-                List *stacktail = env->stack->next;
-                env->stack->next = bools;
-                bools = env->stack;
-                env->stack = stacktail;
-            }
-        }
+    takeTailPos(env);
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    argsOrWarn(args);
 
-        freeList(tests);
+    if(sig == 0) {
+        List *tests = args[0].value.list;
+        bool ans = true;
 
-        while(bools != NULL) {
-            if(pop(&bools).value.boolean != true) {
-                freeList(bools);
-                env->stack = consBool(false, env->stack);
-                return;
+        for(List *cur = tests; cur != NULL; cur = cur->next) {
+            evalBound(cur->val, cur, env);
+            Symbol *top = peek(env, 0);
+            if(top != NULL && top->type == BOOLEAN) {
+                ans &= popStack(env).value.boolean;
             }
         }
 
-        env->stack = consBool(true, env->stack);
+        freeList(tests);
+        pushBool(env, ans);
 
         return;
     }
-    args = getArgs(env,  2, (int[]) { BOOLEAN, BOOLEAN });
-    argsOrWarn(args);
 
-    bool a = pop(&args).value.boolean;
-    bool b = pop(&args).value.boolean;
+    bool a = args[0].value.boolean;
+    bool b = args[1].value.boolean;
 
-    env->stack = consBool(a && b, env->stack);
+    pushBool(env, a && b);
 }
 
 void builtin_lt (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, INT });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, INT });
     argsOrWarn(args);
 
-    int a = pop(&args).value.integer;
-    int b = args->val.value.integer;
+    int a = args[0].value.integer;
+    Symbol b = args[1];
 
-    args->next = env->stack;
-    env->stack = args;
-
-    env->stack = consBool(a > b, env->stack);
+    push(env, b);
+    pushBool(env, a > b.value.integer);
 
     // > is used to make it more intuitve, as stack
     // is reverse to order in the code.
 }
 
 void builtin_lte (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, INT });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, INT });
     argsOrWarn(args);
 
-    int a = pop(&args).value.integer;
-    int b = args->val.value.integer;
-
-    args->next = env->stack;
-    env->stack = args;
+    int a = args[0].value.integer;
+    Symbol b = args[1];
 
-    env->stack = consBool(a >= b, env->stack);
+    push(env, b);
+    pushBool(env, a >= b.value.integer);
 
     // > is used to make it more intuitve, as stack
     // is reverse to order in the code.
 }
 
 void builtin_gt (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, INT });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, INT });
     argsOrWarn(args);
 
-    int a = pop(&args).value.integer;
-    int b = args->val.value.integer;
+    int a = args[0].value.integer;
+    Symbol b = args[1];
 
-    args->next = env->stack;
-    env->stack = args;
-
-    env->stack = consBool(a < b, env->stack);
+    push(env, b);
+    pushBool(env, a < b.value.integer);
 
     // < is used to make it more intuitve, as stack
     // is reverse to order in the code.
 }
 
 void builtin_gte (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, INT });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, INT });
     argsOrWarn(args);
 
-    int a = pop(&args).value.integer;
-    int b = args->val.value.integer;
-
-    args->next = env->stack;
-    env->stack = args;
+    int a = args[0].value.integer;
+    Symbol b = args[1];
 
-    env->stack = consBool(a <= b, env->stack);
+    push(env, b);
+    pushBool(env, a <= b.value.integer);
 
     // < is used to make it more intuitve, as stack
     // is reverse to order in the code.
 }
 
 void builtin_plus (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, INT });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, INT });
     argsOrWarn(args);
 
-    env->stack = consInt(pop(&args).value.integer
-                        + pop(&args).value.integer,
-                     env->stack);
+    pushInt(env, args[0].value.integer + args[1].value.integer);
 }
 
 void builtin_minus (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, INT });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, INT });
     argsOrWarn(args);
 
-    int b = pop(&args).value.integer;
-    int a = pop(&args).value.integer;
-    env->stack = consInt(a - b, env->stack);
+    int b = args[0].value.integer;
+    int a = args[1].value.integer;
+    pushInt(env, a - b);
 }
 
 void builtin_mul (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, INT });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, INT });
     argsOrWarn(args);
 
-    env->stack = consInt(pop(&args).value.integer
-                        * pop(&args).value.integer,
-                     env->stack);
+    pushInt(env, args[0].value.integer * args[1].value.integer);
 }
 
 void builtin_clone (RunEnv *env) {
-    if(env->stack != NULL) {
-        env->stack = cons((env->stack)->val, env->stack);
+    Symbol *top = peek(env, 0);
+    if(top != NULL) {
+        push(env, refsym(*top));
     }
 }
 
-void builtin_assign (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { ANY, ANY });
-    argsOrWarn(args);
+// Texts of names bound in a pmap body, which may have no global
+// slot to keep a copy. mapQuote() releases them once the body's
+// bindings are gone.
+__thread List *pmapNames = NULL;
+
+// Names made at runtime (>sym) are bound or defined under the
+// copy kept by their global slot, as their text may go before
+// the binding does.
+Symbol keptName (RunEnv *env, Symbol name) {
+    if(name.text == NULL) return name;
+
+    GlobalSlot *slot = NULL;
+    if(!env->inPmap)
+        slot = symtabIntern(env->globals, name.word);
+    else if(env->globals->cap > 0)
+        slot = *symtabSlot(env->globals, name.word,
+                           stringHash(name.word));
+
+    if(slot == NULL) {
+        pmapNames = cons(name, pmapNames);
+        name.text = NULL;
+        return name;
+    }
+
+    String kept = slot->name;
+    releaseText(name.text);
+    name.text = NULL;
+    name.word = name.value.string = kept;
+    return name;
+}
 
-    Symbol name = pop(&args);
-    Symbol val = pop(&args);
+// Takes name and value of assign.
+Symbol *assignArgs (RunEnv *env) {
+    Symbol *args = getArgs(env, 2, (int[]) { ANY, ANY });
+    if(args == NULL) {
+        fprintf(stderr, "builtin_assign: wrong argument list\n");
+        printStackTrace(&errw, env);
+        fail(1);
+    }
 
+    Symbol name = args[0];
     if(name.type != SYMBOL
        || !stringEq(name.word, name.value.string)) {
         fprintf(stderr, "Trying to redefine value of %.*s.\n",
                 (int)name.word.len, name.word.data);
-        printStackTrace(stderr, env);
-        exit(1); 
+        printStackTrace(&errw, env);
+        fail(1); 
     } 
 
-    env->scopeStack->val.value.list
-        = cons((Symbol) {
-                .word = name.word,
-                .type = val.type,
-                .value = val.value }, 
-            env->scopeStack->val.value.list);
+    args[0] = keptName(env, name);
+    return args;
+}
+
+// assign to a slot of the running frame, see linkLocals().
+void assignLocal (RunEnv *env, uint local) {
+    Symbol *args = assignArgs(env);
+    Symbol *slot = frameSlot(env, local);
+
+    dropSym(*slot);
+    *slot = (Symbol) {
+                .word = args[0].word,
+                .type = args[1].type,
+                .value = args[1].value,
+                .text = args[1].text };
+}
+
+void builtin_assign (RunEnv *env) {
+    Symbol *args = assignArgs(env);
+    bindVar(env, args[0].word, args[1]);
 }
 
 void evalListExpr(List *listExpr) {
@@ -1667,11 +3782,11 @@ void evalListExpr(List *listExpr) {
 }
 
 bool evalCondexpr (Symbol expr, RunEnv *env) {
-    if(env->stack == NULL) return false;
+    if(env->stack.len == 0) return false;
 
     if(expr.type == LIST) {
         eval(expr, env);
-        Symbol ret = pop(&(env->stack));
+        Symbol ret = popStack(env);
         if(ret.type != BOOLEAN) {
             fprintf(stderr, "evalCondexpr() wrong return value.\n");
             return false;
@@ -1680,27 +3795,28 @@ bool evalCondexpr (Symbol expr, RunEnv *env) {
     } else {
         Symbol ref = findVar(env, expr.word);
         if(ref.type == NOTHING)
-            return symbolEq(expr, (env->stack)->val);
-        return symbolEq(ref, (env->stack)->val);
+            return symbolEq(expr, *peek(env, 0));
+        return symbolEq(ref, *peek(env, 0));
     }
 }
 
 void builtin_match (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { LIST, ANY });
+    bool tail = takeTailPos(env);
+    Symbol *args = getArgs(env, 2, (int[]) { LIST, ANY });
     if(args == NULL)
         return;
 
-    List *rules = pop(&args).value.list;
-    args->next = env->stack;
-    env->stack = args;
+    List *rules = args[0].value.list;
+    push(env, args[1]);
 
     while(rules != NULL && rules->next != NULL) {
         if(evalCondexpr(rules->val, env)) {
             if(rules->next->val.word.len == 0
                 && rules->next->val.type == LIST) {
-                eval(rules->next->val, env);
+                if(tail) evalTail(rules->next->val, false, env);
+                else eval(rules->next->val, env);
             } else {
-                env->stack = cons(rules->next->val, env->stack);
+                push(env, rules->next->val);
             }
             return;
         }
@@ -1712,35 +3828,50 @@ void builtin_match (RunEnv *env) {
         if(rules->val.word.len == 0
             && rules->val.type == LIST) {
             Symbol body = rules->val;
-            eval(body, env);
+            if(tail) evalTail(body, false, env);
+            else eval(body, env);
         } else {
-            env->stack = cons(rules->val, env->stack);
+            push(env, rules->val);
         }
     }
     else
-        env->stack = cons(Nothing, env->stack);
+        push(env, Nothing);
 }
 
 void builtin_if (RunEnv *env) {
-    List *args = getArgs(env, 3, (int[]) { LIST, LIST, BOOLEAN });
-    if(args != NULL) {
-        Symbol ifb = pop(&args);
-        Symbol elseb = pop(&args);
-        bool which = pop(&args).value.boolean;
+    static const Signature sigs[] = {
+        { 3, { LIST, LIST, BOOLEAN } },
+        { 2, { LIST, BOOLEAN } }
+    };
 
-        if(which)
-            eval(ifb, env);
-        else
-            eval(elseb, env);
+    bool tail = takeTailPos(env);
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    argsOrWarn(args);
 
-        freeList(ifb.value.list);
-        freeList(elseb.value.list);
+    if(sig == 0) {
+        Symbol ifb = args[0];
+        Symbol elseb = args[1];
+        bool which = args[2].value.boolean;
+
+        Symbol body = which ? ifb : elseb;
+        freeList((which ? elseb : ifb).value.list);
+
+        if(tail) {
+            evalTail(body, true, env);
+        } else {
+            eval(body, env);
+            freeList(body.value.list);
+        }
     } else {
-        args = getArgs(env, 2, (int[]) { LIST, BOOLEAN });
-        argsOrWarn(args);
-        Symbol ifb = pop(&args);
-        bool which = pop(&args).value.boolean;
+        Symbol ifb = args[0];
+        bool which = args[1].value.boolean;
         
+        if(which && tail) {
+            evalTail(ifb, true, env);
+            return;
+        }
+
         if(which) {
             eval(ifb, env);
         }
@@ -1750,205 +3881,292 @@ void builtin_if (RunEnv *env) {
 }
 
 void builtin_eq (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { ANY, ANY });
+    Symbol *args = getArgs(env, 2, (int[]) { ANY, ANY });
     argsOrWarn(args);
 
-    Symbol a = args->val;
-    Symbol b = args->next->val;
+    Symbol a = args[0];
+    Symbol b = args[1];
+    bool ans = symbolEq(a, b);
 
-    args->next->next = env->stack;
-    env->stack = args->next;
-    args->next = NULL;
-    freeList(args);
+    push(env, b);
+    dropSym(a);
 
-    env->stack = consBool(symbolEq(a, b), env->stack);
+    pushBool(env, ans);
 }
 
 void builtin_neq (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { ANY, ANY });
+    Symbol *args = getArgs(env, 2, (int[]) { ANY, ANY });
     argsOrWarn(args);
 
-    Symbol a = args->val;
-    Symbol b = args->next->val;
+    Symbol a = args[0];
+    Symbol b = args[1];
+    bool ans = !symbolEq(a, b);
 
-    args->next->next = env->stack;
-    env->stack = args->next;
-    args->next = NULL;
-    freeList(args);
+    push(env, b);
+    dropSym(a);
 
-    env->stack = consBool(!symbolEq(a, b), env->stack);
+    pushBool(env, ans);
 }
 
 void builtin_at (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, STRING });
-    if(args == NULL) {
-        List *args = getArgs(env, 2, (int[]) { INT, ARRAY });
-        argsOrWarn(args);
+    static const Signature sigs[] = {
+        { 2, { INT, STRING } },
+        { 2, { INT, ARRAY } },
+        { 2, { INT, VECTOR } },
+        { 2, { INT, DEQUE } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    argsOrWarn(args);
+
+    if(sig == 3) {
+        int idx = args[0].value.integer;
+        Symbol dq = args[1];
+        Deque *d = dq.value.deque;
+        push(env, dq);
+
+        if(idx >= d->len || idx < 0)
+            push(env, Nothing);
+        else
+            push(env, refsym(*dequeAt(d, idx)));
+
+        return;
+    }
+
+    if(sig == 2) {
+        int idx = args[0].value.integer;
+        Symbol vec = args[1];
+        Vector *v = vec.value.vector;
+        push(env, vec);
+
+        if(idx >= v->len || idx < 0)
+            push(env, Nothing);
+        else
+            push(env, refsym(v->data[idx]));
+
+        return;
+    }
 
-        int idx = pop(&args).value.integer;
-        StringArray sar = args->val.value.array;
-        args->next = env->stack;
+    if(sig == 1) {
+        int idx = args[0].value.integer;
+        Symbol arr = args[1];
+        StringArray sar = arr.value.array;
+        push(env, arr);
 
         if(idx >= sar.len || idx < 0)
-            env->stack = cons(Nothing, args);
+            push(env, Nothing);
         else
-            env->stack = consString(sar.data[idx], args);
+            pushString(env, sar.data[idx]);
 
         return;
     }
 
-    int idx = pop(&args).value.integer;
-    String src = args->val.value.string;
-    args->next = env->stack;
+    int idx = args[0].value.integer;
+    Symbol str = args[1];
+    String src = str.value.string;
+    push(env, str);
 
     if(idx >= src.len || idx < 0)
-        env->stack = cons(Nothing, args);
+        push(env, Nothing);
     else 
-        env->stack = consChar(src.data[idx], args);
+        pushChar(env, src.data[idx]);
 }
 
 void builtin_len (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]) { STRING });
-    if(args == NULL) {
-        args = getArgs(env, 1, (int[]) { LIST });
-        argsOrWarn(args);
+    static const Signature sigs[] = {
+        { 1, { STRING } },
+        { 1, { LIST } },
+        { 1, { BUILDER } },
+        { 1, { VECTOR } },
+        { 1, { DEQUE } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    argsOrWarn(args);
+
+    if(sig == 4) {
+        push(env, args[0]);
+        pushInt(env, args[0].value.deque->len);
+        return;
+    }
 
-        List *l = args->val.value.list;
+    if(sig == 3) {
+        push(env, args[0]);
+        pushInt(env, args[0].value.vector->len);
+        return;
+    }
+
+    if(sig == 2) {
+        push(env, args[0]);
+        pushInt(env, args[0].value.builder->len);
+        return;
+    }
+
+    if(sig == 1) {
+        Symbol lst = args[0];
+        List *l = lst.value.list;
         uint i = 0;
         while(l != NULL) {
             i++;
             l = l->next;
         }
 
-        args->next = env->stack;
-        env->stack = consInt(i, args);
+        push(env, lst);
+        pushInt(env, i);
         return;
     }
 
-    String s = args->val.value.string;
-    args->next = env->stack;
-    env->stack = consInt(s.len, args);
+    Symbol s = args[0];
+    push(env, s);
+    pushInt(env, s.value.string.len);
 }
 
 void builtin_moveArg (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]) { INT });
+    Symbol *args = getArgs(env, 1, (int[]) { INT });
     argsOrWarn(args);
 
-    int n = pop(&args).value.integer;
-    uint i = 0;
-    List *cur = env->stack;
-    while(i < n-1 && cur != NULL) {
-        cur = cur->next;
-        i++;
+    int n = args[0].value.integer;
+    if(n < 1 || n >= env->stack.len) {
+        push(env, Nothing);
+        return;
     }
 
-    if(i != n - 1 || cur == NULL || cur->next == NULL) {
-        env->stack = cons(Nothing, env->stack);
-    } else {
-        List *mem = cur->next;
-        cur->next = mem->next;
-        mem->next = env->stack;
-        env->stack = mem;
-    }
+    Symbol *mem = peek(env, n);
+    Symbol moved = *mem;
+    memmove(mem, mem + 1, n * sizeof(Symbol));
+    *peek(env, 0) = moved;
 }
 
 void builtin_drop (RunEnv *env) {
-    freeList(env->stack);
-    env->stack = NULL;
+    while(env->stack.len > 0)
+        dropSym(popStack(env));
 }
 
 void builtin_dropOne (RunEnv *env) {
-    Symbol s = pop(&(env->stack));
-    if(s.type == LIST)
-        freeList(s.value.list);
+    dropSym(popStack(env));
 }
 
 void builtin_append (RunEnv *env) {
-    List *args = getArgs(env, 2, (int []) { ANY, LIST });
+    static const Signature sigs[] = {
+        { 2, { ANY, LIST } },
+        { 2, { ANY, VECTOR } },
+        { 2, { ANY, DEQUE } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
     argsOrWarn(args);
 
-    List *newstack = args->next;
-    args->next = NULL;
-    if(newstack->val.value.list == NULL) {
-        newstack->val.value.list = args;
+    if(sig == 2) {
+        Symbol dq = args[1];
+        dequePushBack(dq.value.deque, args[0]);
+        push(env, dq);
+        return;
+    }
+
+    if(sig == 1) {
+        Symbol vec = args[1];
+        vectorPush(vec.value.vector, args[0]);
+        push(env, vec);
+        return;
+    }
+
+    List *cell = cons(args[0], NULL);
+    Symbol lst = args[1];
+    if(lst.value.list == NULL) {
+        lst.value.list = cell;
     } else {
         List *cur;
-        for(cur = newstack->val.value.list;
+        for(cur = lst.value.list;
             cur->next != NULL;
             cur = cur->next);
             
-        cur->next = args;
+        cur->next = cell;
     }
 
-    env->stack = newstack;
+    push(env, lst);
 }
 
 void builtin_stash (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]) { INT, ANY });
+    Symbol *args = getArgs(env, 2, (int[]) { INT, ANY });
     argsOrWarn(args);
-    int distance = pop(&args).value.integer;
-    Symbol val = pop(&args);
+    int distance = args[0].value.integer;
+    Symbol val = args[1];
 
-    List *cur = env->stack;
-    for(int i = 1; i < distance; i++)
-         cur = cur->next;
-
-    if(cur == NULL) {
+    size_t depth = (distance > 1) ? distance : 1;
+    if(depth > env->stack.len) {
         fprintf(stderr, "builtin_stash: to short stack for len=%d\n",
                 distance);
         return;
     }
 
-    if(cur->next != NULL && cur->next->val.type == LIST) {
-         Symbol *s = &(cur->next->val);
+    Symbol *s = peek(env, depth);
+    if(s != NULL && s->type == LIST) {
          s->value.list = cons(val, s->value.list);
-    } else
-         cur->next = consList(cur->next,
-                              cons(val, NULL));
+    } else {
+         Stack *st = &(env->stack);
+         stackReserve(st, 1);
+
+         Symbol *at = st->data + st->len - depth;
+         memmove(at + 1, at, depth * sizeof(Symbol));
+         *at = listSymbol("", cons(val, NULL));
+         st->len++;
+    }
 }
 
 void builtin_defun (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]){ANY, LIST});
+    Symbol *args = getArgs(env, 2, (int[]){ANY, LIST});
     argsOrWarn(args);
     
-    Symbol sym = pop(&args);
+    Symbol sym = args[0];
+    Symbol body = args[1];
     if(sym.type != SYMBOL
         || !stringEq(sym.word, sym.value.string)) {
         fprintf(stderr, "Trying to redefine value of %.*s.\n",
                 (int) sym.word.len, sym.word.data);
-        printStackTrace(stderr, env);
-        exit(1);
+        printStackTrace(&errw, env);
+        fail(1);
+    }
+
+    if(env->inPmap) {
+        fprintf(stderr, "Can't define %.*s inside pmap.\n",
+                (int) sym.word.len, sym.word.data);
+        printStackTrace(&errw, env);
+        fail(1);
     }
 
-    args->val.type = FUNCTION;
-    args->val.word = sym.word;
-    args->next = env->globals;
-    env->globals = args;
+    body.type = FUNCTION;
+    body.word = keptName(env, sym).word;
+    symtabDefine(env->globals, cons(body, NULL));
+    linkBody(env->globals, body.value.list);
+    linkLocals(env->globals, body.value.list);
 }
 
 void builtin_reverse (RunEnv *env) {
-    List *args = getArgs(env, 1, (int[]){LIST});
+    Symbol *args = getArgs(env, 1, (int[]){LIST});
     if(args != NULL) {
-        List *oldList = args->val.value.list;
-        args->val.value.list = reversedList(oldList);
+        Symbol lst = args[0];
+        List *oldList = lst.value.list;
+        lst.value.list = reversedList(oldList);
 
-        args->next = env->stack;
-        env->stack = args;
+        push(env, lst);
 
         freeList(oldList);
     }
 }
 
 void builtin_doCounting (RunEnv *env) {
-    List *args = getArgs(env, 3, (int[]){INT, INT, LIST});
+    Symbol *args = getArgs(env, 3, (int[]){INT, INT, LIST});
     argsOrWarn(args);
 
-    int to = pop(&args).value.integer;
-    int from = pop(&args).value.integer;
-    Symbol commands = pop(&args);
+    int to = args[0].value.integer;
+    int from = args[1].value.integer;
+    Symbol commands = args[2];
 
     for(int i = from; i <= to; i++) {
-        env->stack = consInt(i, env->stack);
+        pushInt(env, i);
         eval(commands, env);
     }
 
@@ -1956,15 +4174,15 @@ void builtin_doCounting (RunEnv *env) {
 }
     
 void builtin_doWhile (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]){LIST, LIST});
+    Symbol *args = getArgs(env, 2, (int[]){LIST, LIST});
     if(args == NULL) {
         fprintf(stderr, "wrong arguments for doWhile(List, List)\n");
         return;
     }
 
-    Symbol condition = pop(&args);
-    Symbol body = pop(&args);
-    List *ans;
+    Symbol condition = args[0];
+    Symbol body = args[1];
+    Symbol *ans;
 
     do {
         eval(body, env);
@@ -1972,40 +4190,40 @@ void builtin_doWhile (RunEnv *env) {
         ans = getArgs(env, 1, (int[]){BOOLEAN});
         if(ans == NULL) {
             fprintf(stderr, "Wrong condition for doWhile()\n");
-            printSymbol(stderr, (env->stack)->val);
+            printSymbol(&errw, popStack(env));
 
             freeList(body.value.list);
             freeList(condition.value.list);
             return;
         }
-    } while (ans->val.value.boolean);
+    } while (ans[0].value.boolean);
 
     freeList(body.value.list);
     freeList(condition.value.list);
 }
 
 void builtin_whileDo (RunEnv *env) {
-    List *args = getArgs(env, 2, (int[]){LIST, LIST});
+    Symbol *args = getArgs(env, 2, (int[]){LIST, LIST});
     if(args == NULL) {
         fprintf(stderr, "wrong arguments for whileDo(List, List)\n");
         return;
     }
 
-    Symbol condition = pop(&args);
-    Symbol body = pop(&args);
+    Symbol condition = args[0];
+    Symbol body = args[1];
  
     while (true) {
         eval(condition, env);
-        List *ans = getArgs(env, 1, (int[]){BOOLEAN});
+        Symbol *ans = getArgs(env, 1, (int[]){BOOLEAN});
         if(ans == NULL) {
             fprintf(stderr, "Wrong condition for whileDo()\n");
-            printSymbol(stderr, env->stack->val);
+            printSymbol(&errw, popStack(env));
 
             freeList(body.value.list);
             freeList(condition.value.list);
             return;
         }
-        if(!pop(&ans).value.boolean) break;
+        if(!ans[0].value.boolean) break;
 
         eval(body, env);
     }
@@ -2015,201 +4233,2175 @@ void builtin_whileDo (RunEnv *env) {
 }
 
 void builtin_content (RunEnv *env) {
-    verifyArg(env->stack, ".");
-
-    Symbol s = pop(&(env->stack));
+    verifyArg(env, ".");
 
-    const char *opar = "( ", *cpar = " )";
+    Symbol s = popStack(env);
 
     if(s.type == LIST) {
-        printSymbol(stdout, s);
+        printSymbol(&outw, s);
         freeList(s.value.list);
+    } else if(s.type == VECTOR || s.type == DEQUE) {
+        printSymbol(&outw, s);
+        dropSym(s);
     } else if(s.type == ARRAY) {
         StringArray arr = s.value.array;
-        fputs(opar, stdout);
-        uint i = 0;
-        for(; i < arr.len-1; i++) {
-            printf("%.*s ", (int)arr.data[i].len,
-                            arr.data[i].data);
+        writeConst(&outw, "( ");
+        for(uint i = 0; i < arr.len; i++) {
+            if(i > 0) writeChar(&outw, ' ');
+            writeStr(&outw, arr.data[i]);
         }
-        printf("%.*s", (int)arr.data[i].len, arr.data[i].data);
-        fputs(cpar,stdout);
+        writeConst(&outw, " )");
         free_StringArray(arr);
     } else if(s.type == SOURCE) {
         Source src = s.value.source;
-        printf("%.*s", (int)src.len, src.buff);
+        writeBytes(&outw, src.buff, src.len);
         close_source(src);
     }
     else if(s.type == STRING) {
-        String str = s.value.string;
-        printf("%.*s", (int)str.len, str.data);
+        writeStr(&outw, s.value.string);
+        dropSym(s);
+    } else if(s.type == BUILDER) {
+        writeBytes(&outw, s.value.builder->data, s.value.builder->len);
+        releaseBuilder(s.value.builder);
     } else if(s.type == SYMBOL) {
-        String str = s.value.string;
-        printf("%.*s", (int)str.len, str.data);
+        writeStr(&outw, s.value.string);
+        dropSym(s);
     } else if(s.type == INT) {
-        int n = s.value.integer;
-        printf("%d", n);
+        writeInt(&outw, s.value.integer);
     } else if(s.type == CHAR) {
-        printf("%c", s.value.character);
+        writeChar(&outw, s.value.character);
     } else if(s.type == BOOLEAN) {
-        bool b = s.value.boolean;
-        printf("%s", b?"true":"false");
+        if(s.value.boolean) writeConst(&outw, "true");
+        else writeConst(&outw, "false");
     }
+
+    if(outw.autoflush) flushWriter(&outw);
+}
+
+void builtin_flush (RunEnv *env) {
+    flushWriter(&outw);
 }
 
 void builtin_load (RunEnv *env) {
-    String fname;
-    List *args = getArgs(env, 1, (int[]) { SYMBOL });
-    if(args != NULL)
-        fname = pop(&args).value.string;
-    else {
-        args = getArgs(env, 1, (int[]) { STRING });
-        argsOrWarn(args);
+    static const Signature sigs[] = {
+        { 1, { SYMBOL } },
+        { 1, { STRING } }
+    };
 
-        fname = pop(&args).value.string;
-    }
+    Symbol *args;
+    overload(env, sigs, &args);
+    argsOrWarn(args);
 
+    String fname = args[0].value.string;
+
+    // Source keeps the name, so it must outlive this call.
     char buff[fname.len+1];
     buff[fname.len] = 0;
     strncpy(buff, fname.data, fname.len);
-    env->stack = cons((Symbol){.word = fname,
-                               .type = SOURCE,
-                               .value.source = load_file(buff)},
-                      env->stack);
+    push(env, (Symbol){.word = fname,
+                       .type = SOURCE,
+                       .value.source = load_file(
+                                keepString(buff, sizeof(buff)).data),
+                       .text = args[0].text});
 }
 
-void builtin_cut (RunEnv *env) {
-    String      srcstr;
-    StringArray seps;
+void builtin_stream (RunEnv *env) {
+    static const Signature sigs[] = {
+        { 1, { SYMBOL } },
+        { 1, { STRING } }
+    };
 
-    List *args = getArgs(env, 2, (int[]){ ARRAY, STRING });
-    if(args == NULL) {
-        fprintf(stderr, "wrong args for cut().\n");
-        return;
-    }
-    seps = pop(&args).value.array;
-    srcstr = pop(&args).value.string;
-
-    for(uint i = 0; i < srcstr.len; i++) {
-        for(uint j = 0; j < seps.len; j++) {
-            String sep = seps.data[j];
-            if(sep.len > srcstr.len - i) continue;
-            if(strncmp(sep.data, srcstr.data+i, sep.len) == 0) {
-                String str = {.data = srcstr.data+i+sep.len,
-                              .len = srcstr.len - i - sep.len };
-                pushStr(&(env->stack), str);
-                String s = {.data = srcstr.data,
-                            .len = i};
-                pushStr(&(env->stack), s);
-                free_StringArray(seps);
-                return;
-            }
-        } 
-    }
+    Symbol *args;
+    overload(env, sigs, &args);
+    argsOrWarn(args);
 
-    free_StringArray(seps);
-    env->stack = cons((Symbol) {
-                .word = constString(""),
-                .type = NOTHING
-            }, env->stack);
-    pushStr(&(env->stack), srcstr);
+    String fname = args[0].value.string;
+    push(env, (Symbol){.word = fname,
+                       .type = STREAM,
+                       .value.stream = openStream(fname),
+                       .text = args[0].text});
 }
 
-void builtin_substr(RunEnv *env) {
-    List *args = getArgs(env, 3, (int[]) { INT, INT, STRING });
+// Pushes next line of the stream or nothing at its end. Line is
+// a copy, as the stream's buffer is refilled under it.
+void builtin_line (RunEnv *env) {
+    Symbol *args = getArgs(env, 1, (int[]){ STREAM });
+    argsOrWarn(args);
+
+    Symbol st = args[0];
+    String line;
+    push(env, st);
+
+    if(streamRecord(st.value.stream, '\n', &line))
+        push(env, textSymbol(line.data, line.len));
+    else
+        push(env, Nothing);
+}
+
+// Evaluates body with each line of the stream on top, like
+// doCounting does with numbers, so it can fold over them.
+void builtin_eachLine (RunEnv *env) {
+    Symbol *args = getArgs(env, 2, (int[]){ LIST, STREAM });
     argsOrWarn(args);
 
-    int end = pop(&args).value.integer;
-    int start = pop(&args).value.integer;
+    Symbol body = args[0];
+    Stream *st = args[1].value.stream;
+
+    String line;
+    while(streamRecord(st, '\n', &line)) {
+        push(env, textSymbol(line.data, line.len));
+        eval(body, env);
+    }
+
+    freeList(body.value.list);
+    releaseStream(st);
+}
 
-    String str = args->val.value.string;
+// pmap evaluates a quotation for every element of a list on a
+// pool of threads, kept by the calling thread from its first pmap
+// until its interpreters are gone (see pmapStop()). Each thread
+// runs its own RunEnv over the caller's globals and scopes, which
+// stay read-only meanwhile (see RunEnv.inPmap), with cells and
+// strings from its own pools. Elements are split in chunks the
+// threads take in turn, the caller among them. Results are
+// encoded as encodeSym() records per chunk and decoded in order,
+// so what a body returns is the same type of value, owned by the
+// caller, whether or not it ran on another thread. Threads' output
+// is flushed when a call ends, so it may interleave.
+#define PMAP_MAX_WORKERS 64
+#define PMAP_CHUNKS_PER_WORKER 4
+
+// Runs body on a fresh stack holding just elem, returns the top
+// of what it leaves.
+Symbol mapQuote (RunEnv *env, Symbol body, Symbol elem) {
+    RunEnv inenv = {.stack = { .data = NULL },
+                    .globals = env->globals,
+                    .scopeStack = env->scopeStack,
+                    .inPmap = true };
+    List *outerNames = pmapNames;
+    pmapNames = NULL;
+
+    push(&inenv, elem);
+    eval(body, &inenv);
+
+    Symbol ans = popStack(&inenv);
+    while(inenv.stack.len > 0)
+        dropSym(popStack(&inenv));
+    free(inenv.stack.data);
+    free(inenv.locals.data);
+
+    freeList(pmapNames);
+    pmapNames = outerNames;
+    return ans;
+}
 
-    args->next = env->stack;
-    env->stack = consString(
-        (String){.data = str.data+start,
-                 .len = end - start },
-        args);
+void encodeRaw (Builder *out, const void *data, size_t len) {
+    builderAppend(out, data, len);
 }
 
-List *varstash = NULL;
-List *scopestash = NULL;
-List *stackstash = NULL;
+void encodeLen (Builder *out, uint64_t len) {
+    encodeRaw(out, &len, sizeof(len));
+}
 
-void builtin_isString(RunEnv *env) {
-    if(env->stack == NULL) {
-        consBool(false, env->stack);
-        return;
+void encodeStr (Builder *out, String s) {
+    encodeLen(out, s.len);
+    encodeRaw(out, s.data, s.len);
+}
+
+// Type byte, then the value. Lists, vectors and deques hold their
+// element count and elements, builders are sent as strings.
+void encodeSym (Builder *out, Symbol s) {
+    uint8_t type = (s.type == BUILDER) ? STRING : s.type;
+    encodeRaw(out, &type, 1);
+
+    switch(s.type) {
+        case NOTHING:
+            break;
+        case INT:
+            encodeRaw(out, &s.value.integer, sizeof(s.value.integer));
+            break;
+        case CHAR:
+            encodeRaw(out, &s.value.character, 1);
+            break;
+        case BOOLEAN: {
+            uint8_t b = s.value.boolean;
+            encodeRaw(out, &b, 1);
+            break;
+        }
+        case STRING: case SYMBOL:
+            encodeStr(out, s.value.string);
+            break;
+        case BUILDER:
+            encodeStr(out, (String) { .data = s.value.builder->data,
+                                      .len = s.value.builder->len });
+            break;
+        case ARRAY:
+            encodeLen(out, s.value.array.len);
+            for(uint i = 0; i < s.value.array.len; i++)
+                encodeStr(out, s.value.array.data[i]);
+            break;
+        case LIST: {
+            uint64_t len = 0;
+            for(List *cur = s.value.list; cur != NULL; cur = cur->next)
+                len++;
+            encodeLen(out, len);
+            for(List *cur = s.value.list; cur != NULL; cur = cur->next)
+                encodeSym(out, cur->val);
+            break;
+        }
+        case VECTOR:
+            encodeLen(out, s.value.vector->len);
+            for(size_t i = 0; i < s.value.vector->len; i++)
+                encodeSym(out, s.value.vector->data[i]);
+            break;
+        case DEQUE:
+            encodeLen(out, s.value.deque->len);
+            for(size_t i = 0; i < s.value.deque->len; i++)
+                encodeSym(out, *dequeAt(s.value.deque, i));
+            break;
+        default:
+            fprintf(stderr, "pmap: worker can't send back ");
+            printSymbol(&errw, s);
+            fprintf(stderr, "\n");
+            fail(1);
     }
-    int type = (env->stack)->val.type;
-    if(type == NOTHING) {
-        pop(&(env->stack));
-        env->stack = consBool(false, env->stack);
-    } else if (type == STRING) {
-        env->stack = consBool(true, env->stack);
-    } else {
-        env->stack = consBool(false, env->stack);
+}
+
+typedef struct Decoder {
+    const char  *pos, *end;
+} Decoder;
+
+void decodeRaw (Decoder *d, void *data, size_t len) {
+    if(len > (size_t) (d->end - d->pos)) {
+        fprintf(stderr, "pmap: truncated worker result\n");
+        fail(1);
     }
+
+    memcpy(data, d->pos, len);
+    d->pos += len;
 }
 
-void builtin_isList(RunEnv *env) {
-    if(env->stack == NULL) {
-        consBool(false, env->stack);
-        return;
+uint64_t decodeLen (Decoder *d) {
+    uint64_t len;
+    decodeRaw(d, &len, sizeof(len));
+    return len;
+}
+
+// Next string, pointing into the decoded buffer.
+String decodeStr (Decoder *d) {
+    uint64_t len = decodeLen(d);
+    if(len > (size_t) (d->end - d->pos)) {
+        fprintf(stderr, "pmap: truncated worker result\n");
+        fail(1);
     }
-    int type = (env->stack)->val.type;
-    if(type == NOTHING) {
-        pop(&(env->stack));
-        env->stack = consBool(false, env->stack);
-    } else if (type == LIST) {
-        env->stack = consBool(true, env->stack);
-    } else {
-        env->stack = consBool(false, env->stack);
+
+    String ans = { .data = d->pos, .len = len };
+    d->pos += len;
+    return ans;
+}
+
+Symbol decodeSym (Decoder *d) {
+    uint8_t type;
+    decodeRaw(d, &type, 1);
+
+    Symbol ans = { .word = constString(""), .type = type };
+    switch(type) {
+        case NOTHING:
+            return Nothing;
+        case INT:
+            decodeRaw(d, &ans.value.integer, sizeof(ans.value.integer));
+            break;
+        case CHAR:
+            decodeRaw(d, &ans.value.character, 1);
+            break;
+        case BOOLEAN: {
+            uint8_t b;
+            decodeRaw(d, &b, 1);
+            ans.value.boolean = b;
+            ans.word = b ? constString("true") : constString("false");
+            break;
+        }
+        case STRING: case SYMBOL: {
+            String str = decodeStr(d);
+            Symbol own = textSymbol(str.data, str.len);
+            ans.value.string = ans.word = own.value.string;
+            ans.text = own.text;
+            break;
+        }
+        case ARRAY: {
+            // Bytes of the elements follow them in the block of
+            // the array, so they are freed with it.
+            uint64_t len = decodeLen(d);
+            Decoder scan = *d;
+            size_t bytes = 0;
+            for(uint64_t i = 0; i < len; i++)
+                bytes += decodeStr(&scan).len;
+
+            StringArray arr = {
+                .data = malloc(len * sizeof(String) + bytes),
+                .refs = 1,
+                .len = len };
+            char *pos = (char *) (arr.data + len);
+            for(uint64_t i = 0; i < len; i++) {
+                String str = decodeStr(d);
+                memcpy(pos, str.data, str.len);
+                arr.data[i] = (String) { .data = pos, .len = str.len };
+                pos += str.len;
+            }
+            ans.value.array = arr;
+            break;
+        }
+        case LIST: {
+            uint64_t len = decodeLen(d);
+            List **wcur = &ans.value.list;
+            *wcur = NULL;
+            for(uint64_t i = 0; i < len; i++) {
+                *wcur = cons(decodeSym(d), NULL);
+                wcur = &((*wcur)->next);
+            }
+            break;
+        }
+        case VECTOR: {
+            uint64_t len = decodeLen(d);
+            ans.value.vector = mkVector();
+            for(uint64_t i = 0; i < len; i++)
+                vectorPush(ans.value.vector, decodeSym(d));
+            break;
+        }
+        case DEQUE: {
+            uint64_t len = decodeLen(d);
+            ans.value.deque = mkDeque();
+            for(uint64_t i = 0; i < len; i++)
+                dequePushBack(ans.value.deque, decodeSym(d));
+            break;
+        }
+        default:
+            fprintf(stderr, "pmap: broken worker result\n");
+            fail(1);
     }
+
+    return ans;
 }
 
-void builtin_unquote (RunEnv *env) {
-    List *top = reverseList(env->stack);
-    env->stack = consList(pop(&stackstash).value.list, top);
-    if(stackstash == NULL) {
-        env->scopeStack = scopestash;
-        env->globals = varstash;
+// One pmap call. Threads take chunk numbers from next until
+// they run out or a body fails. Of failed chunks, the first one
+// keeps its fail() code, which the caller fails with, as the
+// same elements in order would.
+typedef struct PmapJob {
+    RunEnv          *env;
+    Symbol          body;
+    Symbol          *items;
+    size_t          count, chunk, chunks;
+    size_t          next;
+    Builder         **results;  // encoded results, one per chunk
+    bool            failed;
+    pthread_mutex_t failLock;
+    size_t          failChunk;
+    int             failCode;
+} PmapJob;
+
+typedef struct PmapPool {
+    pthread_t       threads[PMAP_MAX_WORKERS - 1];
+    uint            count;
+    pthread_mutex_t lock;
+    pthread_cond_t  start, finish;
+    PmapJob         *job;
+    uint64_t        jobs;       // handed out so far
+    uint            running;    // threads still on the job
+    bool            quit;
+} PmapPool;
+
+__thread PmapPool *pmapPool = NULL;
+
+// Runs chunks of job on this thread. An error in a body is printed
+// as usual, then marks the job failed.
+void pmapRun (PmapJob *job) {
+    jmp_buf here;
+    jmp_buf *outer = failJump;
+    failJump = &here;
+    volatile size_t current = 0;
+
+    if(setjmp(here) != 0) {
+        pthread_mutex_lock(&job->failLock);
+        if(current < job->failChunk) {
+            job->failChunk = current;
+            job->failCode = failCode;
+        }
+        pthread_mutex_unlock(&job->failLock);
+
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        freeList(pmapNames);
+        pmapNames = NULL;
+    } else {
+        while(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+            size_t c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+            if(c >= job->chunks) break;
+            current = c;
+
+            size_t to = (c + 1) * job->chunk;
+            if(to > job->count) to = job->count;
+            for(size_t i = c * job->chunk; i < to; i++) {
+                Symbol res = mapQuote(job->env, job->body,
+                                      refsym(job->items[i]));
+                encodeSym(job->results[c], res);
+                dropSym(res);
+            }
+        }
     }
+
+    failJump = outer;
+    flushOutput();
 }
 
-void builtin_nested_quote (RunEnv *env) {
-    stackstash = consList(stackstash, env->stack);
-    env->stack = NULL;
+void *pmapThread (void *arg) {
+    PmapPool *pool = arg;
+    initWriters();
+
+    uint64_t done = 0;
+    pthread_mutex_lock(&pool->lock);
+    while(true) {
+        while(!pool->quit && pool->jobs == done)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if(pool->quit) break;
+
+        done = pool->jobs;
+        PmapJob *job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        pmapRun(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->running == 0)
+            pthread_cond_signal(&pool->finish);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    releaseCells();
+    releaseStrings();
+    return NULL;
 }
 
-void builtin_quote (RunEnv *env) {
-    varstash = env->globals; 
-    scopestash = env->scopeStack;
-    stackstash = consList(NULL, env->stack);
+// The pool of the thread, made with count threads on first use.
+// It never grows, as threads joining between jobs couldn't tell
+// which was handed out last.
+PmapPool *pmapStart (uint count) {
+    if(pmapPool != NULL) return pmapPool;
+
+    PmapPool *pool = malloc(sizeof(PmapPool));
+    *pool = (PmapPool) { .count = 0, .jobs = 0, .quit = false };
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+
+    // Runs with the threads it could start, if any.
+    while(pool->count < count
+          && pthread_create(pool->threads + pool->count, NULL,
+                            pmapThread, pool) == 0)
+        pool->count++;
+
+    pmapPool = pool;
+    return pool;
+}
 
-    env->stack = NULL;
-    env->scopeStack = NULL;
-    env->globals = cons((Symbol) {
-/*(*/             .word = constString(")"),
-                  .type = BUILTIN,
-                  .value.builtin = &builtin_unquote},
-                cons((Symbol) {
-                     .word = constString("("), //)
-                     .type = BUILTIN,
-                     .value.builtin = &builtin_nested_quote},
-                     NULL));
+// Ends the threads of the pool, if the thread made one.
+void pmapStop () {
+    PmapPool *pool = pmapPool;
+    if(pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(uint i = 0; i < pool->count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finish);
+    free(pool);
+    pmapPool = NULL;
 }
 
-extern char _binary_lerl_lrc_start;
-extern char _binary_lerl_lrc_end;
+List *pmapItems (RunEnv *env, Symbol body, List *items, size_t count,
+                 uint workers) {
+    PmapPool *pool = NULL;
+    if(workers > 1 && count > 1) {
+        pool = pmapStart(workers - 1);
+        workers = pool->count + 1;
+    }
+    if(workers > count) workers = count;
+
+    Symbol *itemv = malloc(count * sizeof(Symbol));
+    size_t n = 0;
+    for(List *cur = items; cur != NULL; cur = cur->next)
+        itemv[n++] = cur->val;
+
+    size_t chunk = count / (workers * PMAP_CHUNKS_PER_WORKER);
+    if(chunk == 0) chunk = 1;
+    PmapJob job = { .env = env, .body = body, .items = itemv,
+                    .count = count, .chunk = chunk,
+                    .chunks = (count + chunk - 1) / chunk,
+                    .next = 0, .failed = false,
+                    .failChunk = SIZE_MAX, .failCode = 1 };
+    pthread_mutex_init(&job.failLock, NULL);
+    job.results = malloc(job.chunks * sizeof(Builder *));
+    for(size_t c = 0; c < job.chunks; c++)
+        job.results[c] = mkBuilder();
+
+    if(workers > 1) {
+        // Made here, as a body quoting would otherwise make it on
+        // several threads at once.
+        quoteTable(env->globals);
+        flushOutput();
+
+        __atomic_add_fetch(&sharedRefs, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&pool->lock);
+        pool->job = &job;
+        pool->jobs++;
+        pool->running = pool->count;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        pmapRun(&job);
+
+        pthread_mutex_lock(&pool->lock);
+        while(pool->running > 0)
+            pthread_cond_wait(&pool->finish, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        __atomic_sub_fetch(&sharedRefs, 1, __ATOMIC_SEQ_CST);
+    } else {
+        pmapRun(&job);
+    }
+    free(itemv);
+
+    pthread_mutex_destroy(&job.failLock);
+    if(job.failed) {
+        for(size_t c = 0; c < job.chunks; c++)
+            releaseBuilder(job.results[c]);
+        free(job.results);
+        fail(job.failCode);
+    }
 
-int main(int argc, const char **argv) {
-    List *globalsym = initial_global_symtab(argc-1, argv+1);
-    run_source((Source) {
-                 .name = "(builtin init)",
-                 .buff = &_binary_lerl_lrc_start,
-                 .len = &_binary_lerl_lrc_end - &_binary_lerl_lrc_start,
-                 .fd = -1} , &globalsym);
-    freeList(globalsym);
+    List *ans = NULL;
+    List **wcur = &ans;
+    for(size_t c = 0; c < job.chunks; c++) {
+        Decoder d = { .pos = job.results[c]->data,
+                      .end = job.results[c]->data + job.results[c]->len };
+        while(d.pos < d.end) {
+            *wcur = cons(decodeSym(&d), NULL);
+            wcur = &((*wcur)->next);
+        }
+        releaseBuilder(job.results[c]);
+    }
+    free(job.results);
+
+    return ans;
+}
+
+// Threads for a pmap: LERL_WORKERS if set, mainly for tests, else
+// one per core. Bodies already on a pool run alone.
+uint pmapWorkers (RunEnv *env) {
+    if(env->inPmap) return 1;
+
+    const char *set = getenv("LERL_WORKERS");
+    long n = (set != NULL) ? strtol(set, NULL, 10)
+                           : sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (n > PMAP_MAX_WORKERS) ? PMAP_MAX_WORKERS : n;
+}
+
+// ( list quot -- results ), one per element, in order.
+void builtin_pmap (RunEnv *env) {
+    Symbol *args = getArgs(env, 2, (int[]){ LIST, LIST });
+    argsOrWarn(args);
+
+    Symbol body = args[0];
+    List *items = args[1].value.list;
+
+    size_t count = 0;
+    for(List *cur = items; cur != NULL; cur = cur->next)
+        count++;
+
+    List *ans = (count > 0)
+                ? pmapItems(env, body, items, count, pmapWorkers(env))
+                : NULL;
+
+    freeList(body.value.list);
+    freeList(items);
+    pushList(env, ans);
+}
+
+// Finds the leftmost occurrence of any separator; at the same
+// position, the one listed first wins. Candidates come from
+// scanSet() over separators' first bytes while there are few
+// enough distinct ones, from a byte table otherwise. Empty
+// separators never match.
+#define FINDER_SET 4
+
+typedef struct SepFinder {
+    StringArray seps;
+    uint        nfirst;
+    char        first[FINDER_SET];
+    bool        table[256];
+} SepFinder;
+
+SepFinder mkSepFinder (StringArray seps) {
+    SepFinder f = { .seps = seps };
+    for(uint i = 0; i < seps.len; i++) {
+        if(seps.data[i].len == 0) continue;
+        unsigned char c = seps.data[i].data[0];
+        if(f.table[c]) continue;
+        f.table[c] = true;
+        if(f.nfirst < FINDER_SET) f.first[f.nfirst] = c;
+        f.nfirst++;
+    }
+    return f;
+}
+
+// Returns position of the separator found from pos, or src.len.
+// Length of the separator goes to *seplen.
+size_t findSep (SepFinder *f, String src, size_t pos, size_t *seplen) {
+    if(f->nfirst == 0) return src.len;
+
+    while(pos < src.len) {
+        if(f->nfirst <= FINDER_SET)
+            pos = scanSet(src.data, pos, src.len, f->first, f->nfirst);
+        else
+            while(pos < src.len && !f->table[(unsigned char) src.data[pos]])
+                pos++;
+        if(pos == src.len) break;
+
+        for(uint j = 0; j < f->seps.len; j++) {
+            String sep = f->seps.data[j];
+            if(sep.len == 0 || sep.len > src.len - pos
+               || sep.data[0] != src.data[pos])
+                continue;
+            if(memcmp(sep.data, src.data + pos, sep.len) == 0) {
+                *seplen = sep.len;
+                return pos;
+            }
+        }
+        pos++;
+    }
+
+    return src.len;
+}
+
+void builtin_cut (RunEnv *env) {
+    String      srcstr;
+    StringArray seps;
+
+    Symbol *args = getArgs(env, 2, (int[]){ ARRAY, STRING });
+    if(args == NULL) {
+        fprintf(stderr, "wrong args for cut().\n");
+        return;
+    }
+    seps = args[0].value.array;
+    srcstr = args[1].value.string;
+
+    SepFinder finder = mkSepFinder(seps);
+    size_t seplen;
+    size_t i = findSep(&finder, srcstr, 0, &seplen);
+    free_StringArray(seps);
+
+    Symbol whole = args[1];
+    if(i < srcstr.len) {
+        String str = {.data = srcstr.data+i+seplen,
+                      .len = srcstr.len - i - seplen };
+        push(env, sliceSymbol(whole, str));
+        String s = {.data = srcstr.data,
+                    .len = i};
+        push(env, sliceSymbol(whole, s));
+        dropSym(whole);
+        return;
+    }
+
+    push(env, (Symbol) {
+                .word = constString(""),
+                .type = NOTHING
+            });
+    push(env, whole);
+}
+
+// Splits string on every separator at once: ( str seps -- pieces ).
+// Separators are an array or a single string; empty pieces are kept.
+void builtin_split (RunEnv *env) {
+    static const Signature sigs[] = {
+        { 2, { ARRAY, STRING } },
+        { 2, { STRING, STRING } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    if(sig < 0) {
+        fprintf(stderr, "wrong args for split().\n");
+        return;
+    }
+
+    String src = args[1].value.string;
+    StringArray seps = (sig == 0) ? args[0].value.array
+                     : (StringArray) { .data = &args[0].value.string,
+                                       .len = 1 };
+    SepFinder finder = mkSepFinder(seps);
+
+    List *ans = NULL;
+    List **wcur = &ans;
+    size_t start = 0, seplen;
+    for(;;) {
+        size_t i = findSep(&finder, src, start, &seplen);
+        *wcur = cons(sliceSymbol(args[1],
+                                 (String) {.data = src.data + start,
+                                           .len = i - start }), NULL);
+        wcur = &((*wcur)->next);
+        if(i == src.len) break;
+        start = i + seplen;
+    }
+
+    if(sig == 0) free_StringArray(seps);
+    else dropSym(args[0]);
+    dropSym(args[1]);
+    pushList(env, ans);
+}
+
+// Byte offset of needle in str, or -1.
+long indexOf (String str, String needle) {
+    if(needle.len == 0) return 0;
+    if(needle.len > str.len) return -1;
+
+    StringArray one = { .data = &needle, .len = 1 };
+    SepFinder finder = mkSepFinder(one);
+    size_t seplen;
+    size_t i = findSep(&finder, str, 0, &seplen);
+    return (i == str.len) ? -1 : (long) i;
+}
+
+// ( str needle -- str offset ), offset is Nothing when not found.
+void builtin_indexOf (RunEnv *env) {
+    Symbol *args = getArgs(env, 2, (int[]){ STRING, STRING });
+    if(args == NULL) {
+        fprintf(stderr, "wrong args for indexOf().\n");
+        return;
+    }
+
+    Symbol str = args[1];
+    long i = indexOf(str.value.string, args[0].value.string);
+    dropSym(args[0]);
+    push(env, str);
+    if(i < 0) push(env, Nothing);
+    else pushInt(env, (int) i);
+}
+
+void builtin_contains (RunEnv *env) {
+    Symbol *args = getArgs(env, 2, (int[]){ STRING, STRING });
+    if(args == NULL) {
+        fprintf(stderr, "wrong args for contains().\n");
+        return;
+    }
+
+    Symbol str = args[1];
+    bool found = indexOf(str.value.string, args[0].value.string) >= 0;
+    dropSym(args[0]);
+    push(env, str);
+    pushBool(env, found);
+}
+
+typedef enum CharType {
+    CT_WHITE, CT_NUMBER, CT_QUOTE, CT_SPECHAR, CT_OTHER
+} CharType;
+
+CharType charType (char c) {
+    switch(c) {
+        case ' ': case '\t': case '\n':
+            return CT_WHITE;
+        case '"':
+            return CT_QUOTE;
+        case '(': case ')':
+            return CT_SPECHAR;
+        default:
+            return (c >= '0' && c <= '9') ? CT_NUMBER : CT_OTHER;
+    }
+}
+
+// Same tokens as the lexer from lerl.lrc (readInt, readSym,
+// readQuote), produced in one pass.
+List *tokenize (String src) {
+    List *ans = NULL;
+    List **wcur = &ans;
+
+    size_t i = 0;
+    while(i < src.len) {
+        CharType type = charType(src.data[i]);
+        size_t start = i++;
+
+        if(type == CT_WHITE) continue;
+
+        if(type == CT_NUMBER) {
+            while(i < src.len && charType(src.data[i]) == CT_NUMBER) i++;
+            *wcur = cons(strToInt((String) {.data = src.data + start,
+                                            .len = i - start }),
+                         NULL);
+        } else if(type == CT_QUOTE) {
+            while(i < src.len && src.data[i] != '"') i++;
+            *wcur = consString((String) {.data = src.data + start + 1,
+                                         .len = i - start - 1 },
+                               NULL);
+            if(i < src.len) i++;
+        } else {
+            if(type == CT_OTHER) {
+                while(i < src.len) {
+                    CharType t = charType(src.data[i]);
+                    if(t == CT_WHITE || t == CT_SPECHAR) break;
+                    i++;
+                }
+            }
+
+            String str = {.data = src.data + start, .len = i - start };
+            *wcur = cons((Symbol) { .word = str,
+                                    .type = SYMBOL,
+                                    .value.string = str },
+                         NULL);
+        }
+
+        wcur = &((*wcur)->next);
+    }
+
+    return ans;
+}
+
+// Token cache, enabled by --cache. Tokens of a loaded file are
+// kept in <file>.cache and read back from there while the file's
+// inode, size and modification time are those it was made from,
+// so a hit doesn't read the source. Tokens are stored as positions
+// in the source, so strings point into its mapping, as tokenize()
+// ones do.
+//
+// Layout: CacheHeader, then a tag byte per token: type in bits 0-1
+// (CACHE_TYPES), gap since the previous token's end in bits 2-3 and
+// length in bits 4-7. Fields at their maximum are followed by a
+// varint holding the whole value; INT tokens add one with theirs.
+#define CACHE_SUFFIX ".cache"
+#define CACHE_MAGIC "LERLTOK3"
+#define CACHE_GAP_MAX 3
+#define CACHE_LEN_MAX 15
+
+typedef struct CacheHeader {
+    char        magic[8];
+    uint64_t    ino;
+    int64_t     mtimeSec, mtimeNsec;
+    uint64_t    srclen;
+    uint64_t    count;
+} CacheHeader;
+
+const int CACHE_TYPES[] = { INT, STRING, SYMBOL };
+
+__thread bool cacheTokens = false;
+
+// Header of a cache made from the source with these details.
+CacheHeader cacheHeader (struct stat details) {
+    CacheHeader hdr = { .ino = details.st_ino,
+                        .mtimeSec = details.st_mtim.tv_sec,
+                        .mtimeNsec = details.st_mtim.tv_nsec,
+                        .srclen = details.st_size,
+                        .count = 0 };
+    memcpy(hdr.magic, CACHE_MAGIC, 8);
+    return hdr;
+}
+
+void putVarint (FILE *out, uint64_t val) {
+    while(val >= 0x80) {
+        putc((int) (val & 0x7f) | 0x80, out);
+        val >>= 7;
+    }
+    putc((int) val, out);
+}
+
+// Returns false on truncated or overlong input.
+bool getVarint (const unsigned char **p, const unsigned char *end,
+                uint64_t *val) {
+    *val = 0;
+    for(uint shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char c = *((*p)++);
+        *val |= (uint64_t) (c & 0x7f) << shift;
+        if(c < 0x80) return true;
+    }
+    return false;
+}
+
+// Reads cached tokens of src into *list. False when the cache is
+// missing, stale or broken.
+bool readTokenCache (const char *path, Source src, CacheHeader want,
+                     List **list) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat details;
+    const unsigned char *map = MAP_FAILED;
+    if(fstat(fd, &details) == 0 && details.st_size >= sizeof(CacheHeader))
+        map = mmap(NULL, details.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return false;
+
+    CacheHeader hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    bool valid = memcmp(hdr.magic, want.magic, 8) == 0
+                 && hdr.ino == want.ino
+                 && hdr.mtimeSec == want.mtimeSec
+                 && hdr.mtimeNsec == want.mtimeNsec
+                 && hdr.srclen == want.srclen && hdr.srclen == src.len;
+
+    const unsigned char *p = map + sizeof(hdr);
+    const unsigned char *end = map + details.st_size;
+    uint64_t pos = 0;
+    List *ans = NULL;
+    List **wcur = &ans;
+    for(uint64_t i = 0; valid && i < hdr.count; i++) {
+        if(p == end || (*p & 3) == 3) {
+            valid = false;
+            break;
+        }
+
+        unsigned char tag = *(p++);
+        uint64_t gap = (tag >> 2) & 3, len = tag >> 4;
+        if((gap == CACHE_GAP_MAX && !getVarint(&p, end, &gap))
+           || (len == CACHE_LEN_MAX && !getVarint(&p, end, &len))
+           || gap > src.len - pos || len > src.len - pos - gap) {
+            valid = false;
+            break;
+        }
+
+        String str = { .data = src.buff + pos + gap, .len = len };
+        Symbol sym = { .word = str, .type = CACHE_TYPES[tag & 3] };
+        pos += gap + len;
+
+        if(sym.type == INT) {
+            uint64_t val;
+            valid = getVarint(&p, end, &val);
+            sym.value.integer = (int) (uint32_t) val;
+        } else {
+            sym.value.string = str;
+        }
+
+        *wcur = cons(sym, NULL);
+        wcur = &((*wcur)->next);
+    }
+
+    valid = valid && p == end;
+    munmap((void*) map, details.st_size);
+    if(!valid) {
+        freeList(ans);
+        return false;
+    }
+
+    *list = ans;
+    return true;
+}
+
+// Writes next to path and renames, so readers never see a partial
+// file. Failing to write just leaves the cache out.
+void writeTokenCache (const char *path, Source src, CacheHeader hdr,
+                      List *tokens) {
+    char tmp[strlen(path) + 24];
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid());
+
+    FILE *out = fopen(tmp, "wb");
+    if(out == NULL) return;
+
+    for(List *cur = tokens; cur != NULL; cur = cur->next)
+        hdr.count++;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    uint64_t pos = 0;
+    for(List *cur = tokens; cur != NULL; cur = cur->next) {
+        Symbol s = cur->val;
+        uint64_t off = s.word.data - src.buff;
+        uint64_t gap = off - pos, len = s.word.len;
+        uint type = (s.type == INT) ? 0 : (s.type == STRING) ? 1 : 2;
+        pos = off + len;
+
+        uint gapBits = (gap < CACHE_GAP_MAX) ? gap : CACHE_GAP_MAX;
+        uint lenBits = (len < CACHE_LEN_MAX) ? len : CACHE_LEN_MAX;
+        putc((int) (type | gapBits << 2 | lenBits << 4), out);
+        if(gapBits == CACHE_GAP_MAX) putVarint(out, gap);
+        if(lenBits == CACHE_LEN_MAX) putVarint(out, len);
+        if(s.type == INT) putVarint(out, (uint32_t) s.value.integer);
+    }
+
+    if(ferror(out) | fclose(out) || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+List *tokenizeSource (Source src) {
+    String str = { .data = src.buff, .len = src.len };
+    if(!cacheTokens || src.fd == -1)
+        return tokenize(str);
+
+    char path[strlen(src.name) + sizeof(CACHE_SUFFIX)];
+    strcpy(path, src.name);
+    strcat(path, CACHE_SUFFIX);
+
+    struct stat details;
+    if(fstat(src.fd, &details) != 0 || details.st_size != src.len)
+        return tokenize(str);
+
+    CacheHeader hdr = cacheHeader(details);
+    List *ans;
+    if(readTokenCache(path, src, hdr, &ans))
+        return ans;
+
+    ans = tokenize(str);
+    writeTokenCache(path, src, hdr, ans);
+    return ans;
+}
+
+// Loaded sources stay below the tokens, as strings point into them.
+void builtin_tokenize (RunEnv *env) {
+    static const Signature sigs[] = {
+        { 1, { SOURCE } },
+        { 1, { STRING } }
+    };
+
+    Symbol *args;
+    int sig = overload(env, sigs, &args);
+    argsOrWarn(args);
+
+    if(sig == 0) {
+        Symbol src = args[0];
+        push(env, src);
+        pushList(env, tokenizeSource(src.value.source));
+        return;
+    }
+
+    // Tokens point into the string, so share its text.
+    Symbol str = args[0];
+    List *tokens = tokenize(str.value.string);
+    if(str.text != NULL) {
+        for(List *cur = tokens; cur != NULL; cur = cur->next) {
+            cur->val.text = str.text;
+            refInc(&str.text->refs);
+        }
+    }
+    dropSym(str);
+    pushList(env, tokens);
+}
+
+void builtin_substr(RunEnv *env) {
+    Symbol *args = getArgs(env, 3, (int[]) { INT, INT, STRING });
+    argsOrWarn(args);
+
+    int end = args[0].value.integer;
+    int start = args[1].value.integer;
+    Symbol strsym = args[2];
+
+    String str = strsym.value.string;
+
+    push(env, strsym);
+    push(env, sliceSymbol(strsym, (String){.data = str.data+start,
+                                           .len = end - start }));
+}
+
+void builtin_isString(RunEnv *env) {
+    Symbol *top = peek(env, 0);
+    if(top == NULL) {
+        return;
+    }
+    int type = top->type;
+    if(type == NOTHING) {
+        popStack(env);
+        pushBool(env, false);
+    } else if (type == STRING) {
+        pushBool(env, true);
+    } else {
+        pushBool(env, false);
+    }
+}
+
+void builtin_isList(RunEnv *env) {
+    Symbol *top = peek(env, 0);
+    if(top == NULL) {
+        return;
+    }
+    int type = top->type;
+    if(type == NOTHING) {
+        popStack(env);
+        pushBool(env, false);
+    } else if (type == LIST) {
+        pushBool(env, true);
+    } else {
+        pushBool(env, false);
+    }
+}
+
+void builtin_unquote (RunEnv *env) {
+    size_t mark = pop(&(env->quoteMarks)).value.integer;
+    pushList(env, stackSlice(env, mark));
+    if(env->quoteMarks == NULL) {
+        env->scopeStack = env->quoteScopes;
+        env->globals = env->quoteGlobals;
+    }
+}
+
+void builtin_nested_quote (RunEnv *env) {
+    env->quoteMarks = consInt(env->stack.len, env->quoteMarks);
+}
+
+// Table of quote mode for globals, made on first use.
+SymTab *quoteTable (SymTab *globals) {
+    if(globals->quotes == NULL) {
+        globals->quotes = malloc(sizeof(SymTab));
+        *(globals->quotes) = mkSymTab(
+                    cons((Symbol) {
+/*(*/                    .word = constString(")"),
+                         .type = BUILTIN,
+                         .value.builtin = &builtin_unquote},
+                    cons((Symbol) {
+                         .word = constString("("), //)
+                         .type = BUILTIN,
+                         .value.builtin = &builtin_nested_quote},
+                         NULL)));
+    }
+
+    return globals->quotes;
+}
+
+void builtin_quote (RunEnv *env) {
+    SymTab *globals = env->globals;
+    env->quoteGlobals = globals;
+    env->quoteScopes = env->scopeStack;
+    env->quoteMarks = consInt(env->stack.len, NULL);
+
+    env->scopeStack = NULL;
+    env->globals = quoteTable(globals);
+}
+
+extern char _binary_lerl_lrc_start;
+extern char _binary_lerl_lrc_end;
+
+Source bootstrap () {
+    return (Source) {
+             .name = "(builtin init)",
+             .buff = &_binary_lerl_lrc_start,
+             .len = &_binary_lerl_lrc_end - &_binary_lerl_lrc_start,
+             .fd = -1 };
+}
+
+// Heap image: definitions the bootstrap adds to the initial table,
+// saved by lerl --save-image FILE. Loading one defines and links
+// the same fns without evaluating lerl.lrc. make builds one into
+// lerl and liblerl.so with LERL_IMAGE, lerl --image FILE uses
+// another. Images only hold offsets, so they load wherever mapped,
+// and strings of loaded bodies point into them, so they stay
+// mapped. An image of another bootstrap is ignored.
+//
+// Layout: ImageHeader, then per definition a type byte, its name
+// and its value. Fns hold their body as imageEncode() does, values
+// of builtins the name they have in the initial table.
+#define IMAGE_MAGIC "LERLIMG1"
+
+typedef struct ImageHeader {
+    char        magic[8];
+    uint64_t    bootLen;
+    uint32_t    bootHash, dataHash;
+    uint64_t    dataLen;
+    uint64_t    count;
+} ImageHeader;
+
+__thread const char *imageFile = NULL;
+
+#ifdef LERL_IMAGE
+extern char _binary_lerl_img_start;
+extern char _binary_lerl_img_end;
+#endif
+
+// Body tokens keep their word, which INT ones don't share with
+// their value.
+void imageEncode (Builder *out, Symbol s) {
+    uint8_t type = s.type;
+    encodeRaw(out, &type, 1);
+
+    switch(s.type) {
+        case NOTHING:
+            break;
+        case INT:
+            encodeStr(out, s.word);
+            encodeRaw(out, &s.value.integer, sizeof(s.value.integer));
+            break;
+        case CHAR:
+            encodeStr(out, s.word);
+            encodeRaw(out, &s.value.character, 1);
+            break;
+        case BOOLEAN: {
+            uint8_t b = s.value.boolean;
+            encodeStr(out, s.word);
+            encodeRaw(out, &b, 1);
+            break;
+        }
+        case STRING: case SYMBOL:
+            encodeStr(out, s.word);
+            encodeStr(out, s.value.string);
+            break;
+        case LIST: {
+            uint64_t len = 0;
+            for(List *cur = s.value.list; cur != NULL; cur = cur->next)
+                len++;
+            encodeLen(out, len);
+            for(List *cur = s.value.list; cur != NULL; cur = cur->next)
+                imageEncode(out, cur->val);
+            break;
+        }
+        default:
+            fprintf(stderr, "save-image: can't save ");
+            printSymbol(&errw, s);
+            fprintf(stderr, "\n");
+            fail(1);
+    }
+}
+
+// Strings point into the image.
+Symbol imageDecode (Decoder *d) {
+    uint8_t type;
+    decodeRaw(d, &type, 1);
+
+    Symbol ans = { .type = type };
+    switch(type) {
+        case NOTHING:
+            return Nothing;
+        case INT:
+            ans.word = decodeStr(d);
+            decodeRaw(d, &ans.value.integer, sizeof(ans.value.integer));
+            break;
+        case CHAR:
+            ans.word = decodeStr(d);
+            decodeRaw(d, &ans.value.character, 1);
+            break;
+        case BOOLEAN: {
+            uint8_t b;
+            ans.word = decodeStr(d);
+            decodeRaw(d, &b, 1);
+            ans.value.boolean = b;
+            break;
+        }
+        case STRING: case SYMBOL:
+            ans.word = decodeStr(d);
+            ans.value.string = decodeStr(d);
+            break;
+        case LIST: {
+            uint64_t len = decodeLen(d);
+            List **wcur = &ans.value.list;
+            *wcur = NULL;
+            for(uint64_t i = 0; i < len; i++) {
+                *wcur = cons(imageDecode(d), NULL);
+                wcur = &((*wcur)->next);
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "broken image\n");
+            fail(1);
+    }
+
+    return ans;
+}
+
+ImageHeader imageHeader (Source boot) {
+    ImageHeader hdr = { .bootLen = boot.len,
+                        .bootHash = stringHash((String) {
+                                        .data = boot.buff,
+                                        .len = boot.len }) };
+    memcpy(hdr.magic, IMAGE_MAGIC, 8);
+    return hdr;
+}
+
+// Runs the bootstrap on a fresh table and writes what it defined.
+int saveImage (const char *path) {
+    initWriters();
+
+    SymTab globals = mkSymTab(initial_global_symtab(0, NULL));
+    List *initial = globals.defs;
+    run_source(bootstrap(), &globals);
+
+    // defs is newest first, the image oldest first.
+    size_t count = 0;
+    for(List *cur = globals.defs; cur != initial; cur = cur->next)
+        count++;
+    Symbol *defs = malloc(count * sizeof(Symbol));
+    size_t i = count;
+    for(List *cur = globals.defs; cur != initial; cur = cur->next)
+        defs[--i] = cur->val;
+
+    ImageHeader hdr = imageHeader(bootstrap());
+    Builder *out = mkBuilder();
+    for(i = 0; i < count; i++) {
+        Symbol def = defs[i];
+        uint8_t type = def.type;
+        encodeRaw(out, &type, 1);
+        encodeStr(out, def.word);
+
+        if(def.type == FUNCTION) {
+            imageEncode(out, listSymbol("", def.value.list));
+        } else if(def.type == BUILTIN) {
+            List *b = initial;
+            while(b != NULL && (b->val.type != BUILTIN
+                    || b->val.value.builtin != def.value.builtin))
+                b = b->next;
+            if(b == NULL) {
+                fprintf(stderr, "save-image: %.*s is no builtin\n",
+                        (int) def.word.len, def.word.data);
+                fail(1);
+            }
+            encodeStr(out, b->val.word);
+        } else {
+            imageEncode(out, def);
+        }
+        hdr.count++;
+    }
+    hdr.dataLen = out->len;
+    hdr.dataHash = stringHash((String) { .data = out->data,
+                                         .len = out->len });
+
+    free(defs);
+
+    FILE *file = fopen(path, "wb");
+    bool ok = file != NULL
+              && fwrite(&hdr, sizeof(hdr), 1, file) == 1
+              && fwrite(out->data, 1, out->len, file) == out->len;
+    if(file != NULL && fclose(file) != 0) ok = false;
+    if(!ok) perror(path);
+
+    releaseBuilder(out);
+    freeSymTab(&globals);
+    return ok ? 0 : 1;
+}
+
+// Defines what image of len bytes holds in globals, which have
+// just the initial definitions. False if it isn't an image of
+// this bootstrap, with globals left as they were.
+bool loadImage (SymTab *globals, const char *image, size_t len) {
+    ImageHeader want = imageHeader(bootstrap());
+    ImageHeader hdr;
+    if(len < sizeof(hdr)) return false;
+    memcpy(&hdr, image, sizeof(hdr));
+
+    Decoder d = { .pos = image + sizeof(hdr), .end = image + len };
+    if(memcmp(hdr.magic, want.magic, 8) != 0
+       || hdr.bootLen != want.bootLen || hdr.bootHash != want.bootHash
+       || hdr.dataLen != len - sizeof(hdr)
+       || hdr.dataHash != stringHash((String) { .data = d.pos,
+                                                .len = hdr.dataLen }))
+        return false;
+
+    // Decoded in full first, as builtins may be missing.
+    List *defs = NULL;
+    List **wcur = &defs;
+    bool found = true;
+    for(uint64_t i = 0; i < hdr.count && found; i++) {
+        uint8_t type;
+        decodeRaw(&d, &type, 1);
+        String name = decodeStr(&d);
+
+        Symbol def;
+        if(type == FUNCTION) {
+            def = imageDecode(&d);
+            def.type = FUNCTION;
+        } else if(type == BUILTIN) {
+            def = findGlobal(globals, decodeStr(&d));
+            found = def.type == BUILTIN;
+        } else {
+            def = imageDecode(&d);
+        }
+
+        def.word = name;
+        *wcur = cons(def, NULL);
+        wcur = &((*wcur)->next);
+    }
+
+    if(!found || d.pos != d.end) {
+        freeList(defs);
+        return false;
+    }
+
+    while(defs != NULL) {
+        List *cell = defs;
+        defs = defs->next;
+        symtabDefine(globals, cell);
+        if(cell->val.type == FUNCTION) {
+            linkBody(globals, cell->val.value.list);
+            linkLocals(globals, cell->val.value.list);
+        }
+    }
+    return true;
+}
+
+// Fills fresh globals as the bootstrap would: from the image of
+// --image, else the one built in, else by running lerl.lrc.
+void runBootstrap (SymTab *globals) {
+    if(imageFile != NULL) {
+        int fd = open(imageFile, O_RDONLY);
+        struct stat details;
+        void *map = MAP_FAILED;
+        if(fd >= 0 && fstat(fd, &details) == 0 && details.st_size > 0)
+            map = mmap(NULL, details.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(fd >= 0) close(fd);
+
+        if(map != MAP_FAILED && loadImage(globals, map, details.st_size))
+            return;
+        fprintf(stderr, "%s: not an image of this lerl, ignored\n",
+                imageFile);
+        if(map != MAP_FAILED) munmap(map, details.st_size);
+    }
+
+#ifdef LERL_IMAGE
+    if(loadImage(globals, &_binary_lerl_img_start,
+                 &_binary_lerl_img_end - &_binary_lerl_img_start))
+        return;
+#endif
+
+    run_source(bootstrap(), globals);
+}
+
+// Loads and runs the script named by the first of args.
+const char LAUNCH[] =
+    "args 0 @ load\n"
+    "    nothing = ( missing . #space . argument: . #space . filename .ln 1 exit ) ?\n"
+    "    tokenize 1 >>| ;1 1 >>| ;1 !@\n";
+
+// Runs the bootstrap and the script from args, then frees what
+// it made. State is per thread (see dbg), so threads may run
+// interpreters side by side.
+void interpret (int argc, const char **argv) {
+    initWriters();
+
+    SymTab globals = mkSymTab(initial_global_symtab(argc, argv));
+    runBootstrap(&globals);
+    run_source((Source) { .name = "(launch)", .buff = LAUNCH,
+                          .len = sizeof(LAUNCH) - 1, .fd = -1 },
+               &globals);
+    freeSymTab(&globals);
+    pmapStop();
+    releaseCells();
+    releaseStrings();
+    flushOutput();
+}
+
+// Embedding API, declared in lerl.h. An interpreter keeps its
+// globals and one RunEnv, whose stack lives across evaluations.
+// Cells come from the pool of the thread, which is released with
+// the last of its interpreters, as are strings from keepString().
+//
+// Tokens of evaluated texts and files, and so names, definitions
+// and values made from them, point into them. They are kept in
+// texts until sweepTexts() finds nothing of the interpreter does.
+typedef struct EvalText {
+    Source  src;        // fd -1 for a copy of lerl_eval_string text
+    char    *name;
+    bool    used;
+} EvalText;
+
+#define SWEEP_MIN_BYTES 65536
+
+struct Lerl {
+    SymTab      globals;
+    RunEnv      env;
+    List        *scopes;    // scope stack between evaluations
+    EvalText    *texts;     // sorted by address
+    size_t      textCount, textCap;
+    size_t      textBytes, sweepAt;
+    uint        running;    // evaluations in progress
+};
+
+__thread uint liveInterps = 0;
+
+void releaseEvalText (EvalText t) {
+    if(t.src.fd == -1) free((char *) t.src.buff);
+    else close_source(t.src);
+    free(t.name);
+}
+
+// Pointers seen by a sweep, so shared cells and containers are
+// walked once.
+typedef struct PtrSet {
+    const void  **slots;
+    size_t      cap, count;
+} PtrSet;
+
+bool ptrSetAdd (PtrSet *set, const void *p) {
+    if((set->count + 1) * 2 > set->cap) {
+        PtrSet old = *set;
+        set->cap = (old.cap == 0) ? 1024 : old.cap * 2;
+        set->slots = calloc(set->cap, sizeof(void*));
+        set->count = 0;
+        for(size_t i = 0; i < old.cap; i++)
+            if(old.slots[i] != NULL) ptrSetAdd(set, old.slots[i]);
+        free(old.slots);
+    }
+
+    size_t mask = set->cap - 1;
+    for(size_t i = ((uintptr_t) p >> 4) * 2654435761u & mask;;
+        i = (i + 1) & mask) {
+        if(set->slots[i] == p) return false;
+        if(set->slots[i] == NULL) {
+            set->slots[i] = p;
+            set->count++;
+            return true;
+        }
+    }
+}
+
+typedef struct TextSweep {
+    EvalText    *texts;
+    size_t      count;
+    PtrSet      seen;
+} TextSweep;
+
+void sweepString (TextSweep *sw, String s) {
+    if(sw->count == 0) return;
+
+    uintptr_t p = (uintptr_t) s.data;
+    size_t lo = 0, hi = sw->count;
+    while(hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if((uintptr_t) sw->texts[mid].src.buff <= p) lo = mid;
+        else hi = mid;
+    }
+
+    EvalText *t = sw->texts + lo;
+    uintptr_t start = (uintptr_t) t->src.buff;
+    if(p >= start && p <= start + t->src.len)
+        t->used = true;
+}
+
+void sweepList (TextSweep *sw, List *l);
+
+void sweepSymbol (TextSweep *sw, Symbol s) {
+    sweepString(sw, s.word);
+
+    switch(s.type) {
+        case STRING: case SYMBOL:
+            sweepString(sw, s.value.string);
+            break;
+        case LIST: case FUNCTION: case SCOPE:
+            sweepList(sw, s.value.list);
+            break;
+        case ARRAY:
+            for(size_t i = 0; i < s.value.array.len; i++)
+                sweepString(sw, s.value.array.data[i]);
+            break;
+        case VECTOR:
+            if(ptrSetAdd(&(sw->seen), s.value.vector)) {
+                Vector *v = s.value.vector;
+                for(size_t i = 0; i < v->len; i++)
+                    sweepSymbol(sw, v->data[i]);
+            }
+            break;
+        case DEQUE:
+            if(ptrSetAdd(&(sw->seen), s.value.deque)) {
+                Deque *d = s.value.deque;
+                for(size_t i = 0; i < d->len; i++)
+                    sweepSymbol(sw, *dequeAt(d, i));
+            }
+            break;
+        case STREAM:
+            sweepString(sw, s.value.stream->name);
+            break;
+        default:
+            break;
+    }
+}
+
+void sweepList (TextSweep *sw, List *l) {
+    for(; l != NULL && ptrSetAdd(&(sw->seen), l); l = l->next)
+        sweepSymbol(sw, l->val);
+}
+
+void sweepTable (TextSweep *sw, SymTab *tab) {
+    sweepList(sw, tab->defs);
+    for(Locals *f = tab->frames; f != NULL; f = f->next)
+        for(uint i = 0; i < f->count; i++)
+            sweepString(sw, f->names[i]);
+    if(tab->quotes != NULL) sweepTable(sw, tab->quotes);
+}
+
+// Frees texts nothing reachable from the interpreter points into.
+// Runs between evaluations, when all it holds is reachable from
+// its stack, scopes and globals.
+void sweepTexts (Lerl *lerl) {
+    TextSweep sw = { .texts = lerl->texts, .count = lerl->textCount };
+    for(size_t i = 0; i < sw.count; i++) sw.texts[i].used = false;
+
+    RunEnv *env = &(lerl->env);
+    for(size_t i = 0; i < env->stack.len; i++)
+        sweepSymbol(&sw, env->stack.data[i]);
+    sweepList(&sw, lerl->scopes);
+    sweepTable(&sw, &(lerl->globals));
+    free(sw.seen.slots);
+
+    size_t kept = 0;
+    lerl->textBytes = 0;
+    for(size_t i = 0; i < sw.count; i++) {
+        if(!sw.texts[i].used) {
+            releaseEvalText(sw.texts[i]);
+            continue;
+        }
+        lerl->textBytes += sw.texts[i].src.len;
+        lerl->texts[kept++] = sw.texts[i];
+    }
+    lerl->textCount = kept;
+}
+
+// Adds text to lerl's texts, sweeping them once they have grown
+// to twice what the last sweep kept.
+void keepEvalText (Lerl *lerl, EvalText t) {
+    if(lerl->textCount == lerl->textCap) {
+        lerl->textCap = (lerl->textCap == 0) ? 16 : lerl->textCap * 2;
+        lerl->texts = realloc(lerl->texts,
+                              lerl->textCap * sizeof(EvalText));
+    }
+
+    size_t i = lerl->textCount++;
+    for(; i > 0 && (uintptr_t) lerl->texts[i-1].src.buff
+                   > (uintptr_t) t.src.buff; i--)
+        lerl->texts[i] = lerl->texts[i-1];
+    lerl->texts[i] = t;
+    lerl->textBytes += t.src.len;
+
+    if(lerl->running == 0 && lerl->textBytes >= lerl->sweepAt) {
+        sweepTexts(lerl);
+        lerl->sweepAt = 2 * lerl->textBytes;
+        if(lerl->sweepAt < SWEEP_MIN_BYTES)
+            lerl->sweepAt = SWEEP_MIN_BYTES;
+    }
+}
+
+Lerl *lerl_new (int argc, const char **argv) {
+    initWriters();
+    liveInterps++;
+
+    Lerl *lerl = malloc(sizeof(Lerl));
+    *lerl = (Lerl) { .texts = NULL, .sweepAt = SWEEP_MIN_BYTES };
+    lerl->globals = mkSymTab(initial_global_symtab(argc, argv));
+    lerl->scopes = consList(NULL, NULL);
+    lerl->env = (RunEnv) { .stack = { .data = NULL },
+                           .globals = &(lerl->globals),
+                           .scopeStack = lerl->scopes };
+
+    // setjmp() is only used as a whole controlling expression, the
+    // one use C99 gives a meaning to. Locals set before it are not
+    // changed after it, so they are still valid after longjmp().
+    jmp_buf here;
+    jmp_buf *outer = failJump;
+    failJump = &here;
+    if(setjmp(here) != 0) {
+        failJump = outer;
+        lerl_free(lerl);
+        return NULL;
+    }
+
+    runBootstrap(&(lerl->globals));
+    failJump = outer;
+    return lerl;
+}
+
+void lerl_free (Lerl *lerl) {
+    RunEnv *env = &(lerl->env);
+    while(env->stack.len > 0)
+        dropSym(popStack(env));
+    free(env->stack.data);
+    free(env->locals.data);
+
+    env->scopeStack = lerl->scopes;
+    popScope(env);
+    freeSymTab(&(lerl->globals));
+    for(size_t i = 0; i < lerl->textCount; i++)
+        releaseEvalText(lerl->texts[i]);
+    free(lerl->texts);
+    free(lerl);
+
+    flushOutput();
+    if(--liveInterps == 0) {
+        pmapStop();
+        releaseCells();
+        releaseStrings();
+    }
+}
+
+// Runs src in the interpreter's RunEnv, then keeps it with its
+// texts. After an error the scopes and frames of what the script
+// was in the middle of are released, the stack is left as it was.
+int evalSource (Lerl *lerl, EvalText text) {
+    jmp_buf here;
+    jmp_buf *outer = failJump;
+    failJump = &here;
+    lerl->running++;
+
+    if(setjmp(here) == 0) {
+        runTokens(text.src, &(lerl->env));
+        failCode = 0;
+    } else {
+        while(profDepth > 0) profLeave();
+
+        RunEnv *env = &(lerl->env);
+        if(env->quoteMarks != NULL) {
+            freeList(env->quoteMarks);
+            env->quoteMarks = NULL;
+            env->scopeStack = env->quoteScopes;
+        }
+        while(env->scopeStack != lerl->scopes && env->scopeStack != NULL)
+            popScope(env);
+        while(env->locals.len > 0)
+            dropSym(env->locals.data[--env->locals.len]);
+        if(env->hasTail && env->tailOwned)
+            freeList(env->tail.value.list);
+
+        env->globals = &(lerl->globals);
+        env->frame = NULL;
+        env->frameBase = 0;
+        env->tailPos = env->hasTail = false;
+    }
+
+    lerl->running--;
+    failJump = outer;
+    keepEvalText(lerl, text);
+    flushOutput();
+    return failCode;
+}
+
+int lerl_eval_string (Lerl *lerl, const char *src, size_t len) {
+    char *copy = malloc(len);
+    memcpy(copy, src, len);
+    return evalSource(lerl, (EvalText) {
+                .src = { .name = "(string)", .buff = copy,
+                         .len = len, .fd = -1 },
+                .name = NULL });
+}
+
+int lerl_eval_file (Lerl *lerl, const char *path) {
+    jmp_buf here;
+    jmp_buf *outer = failJump;
+    failJump = &here;
+
+    char *name = strdup(path);
+    if(setjmp(here) != 0) {
+        failJump = outer;
+        free(name);
+        return failCode;
+    }
+
+    Source src = load_file(name);
+    failJump = outer;
+    return evalSource(lerl, (EvalText) { .src = src, .name = name });
+}
+
+void lerl_register (Lerl *lerl, const char *name, LerlBuiltin fn) {
+    // The slot keeps a copy of the name.
+    String word = symtabIntern(&(lerl->globals), mkString(name))->name;
+    symtabDefine(&(lerl->globals),
+                 cons((Symbol) { .word = word,
+                                 .type = BUILTIN,
+                                 .value.builtin = fn }, NULL));
+}
+
+RunEnv *lerl_env (Lerl *lerl) {
+    return &(lerl->env);
+}
+
+size_t lerl_depth (RunEnv *env) {
+    return env->stack.len;
+}
+
+void lerl_push_int (RunEnv *env, int val) {
+    pushInt(env, val);
+}
+
+void lerl_push_string (RunEnv *env, const char *data, size_t len) {
+    push(env, textSymbol(data, len));
+}
+
+bool lerl_pop_int (RunEnv *env, int *val) {
+    Symbol *top = peek(env, 0);
+    if(top == NULL || top->type != INT) return false;
+
+    *val = popStack(env).value.integer;
+    return true;
+}
+
+bool lerl_pop_string (RunEnv *env, char **data, size_t *len) {
+    Symbol *top = peek(env, 0);
+    if(top == NULL || (top->type != STRING && top->type != SYMBOL))
+        return false;
+
+    Symbol sym = popStack(env);
+    String s = sym.value.string;
+    *data = malloc(s.len + 1);
+    memcpy(*data, s.data, s.len);
+    (*data)[s.len] = 0;
+    *len = s.len;
+    dropSym(sym);
+    return true;
+}
+
+void lerl_drop (RunEnv *env) {
+    if(env->stack.len > 0) dropSym(popStack(env));
+}
+
+void lerl_error (RunEnv *env, const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    printStackTrace(&errw, env);
+    fail(1);
+}
+
+#ifndef LERL_LIBRARY
+// Server mode: lerl --serve SOCKET, or --serve - for requests on
+// stdin and responses on stdout. The bootstrap runs once, then
+// each request runs in a child forked from the warm globals, so
+// scripts can't change them for the next ones or kill the server.
+// Each socket connection is served by its own process.
+//
+// Requests:
+//   run PATH ARGS...\n   runs the script as lerl PATH ARGS... does
+//   eval LEN\n TEXT      runs LEN bytes of lerl text
+// Responses, until the script ends:
+//   out LEN\n BYTES      its standard output
+//   err LEN\n BYTES      its standard error
+//   exit STATUS\n        its exit status, 128+signal if killed
+// or "error MESSAGE\n" if the request can't be run. Words of run
+// requests are separated by spaces, so they can't contain them.
+// Request lines are at most REQUEST_MAX bytes and eval texts at
+// most REQUEST_TEXT_MAX, the connection is dropped after a longer
+// one. The socket is made accessible to the server's user only,
+// as whoever can connect runs scripts as that user.
+//
+// lerl --connect SOCKET PATH ARGS... sends a run request, prints
+// the responses and exits with the script's status.
+bool sendAll (int fd, const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool sendFrame (int fd, const char *tag, const char *data, size_t len) {
+    char head[32];
+    int n = snprintf(head, sizeof(head), "%s %zu\n", tag, len);
+    return sendAll(fd, head, n) && sendAll(fd, data, len);
+}
+
+// Forwards child's stdout and stderr as frames until both close.
+void relayOutput (int outFd, int errFd, int to) {
+    struct pollfd fds[2] = {
+        { .fd = outFd, .events = POLLIN },
+        { .fd = errFd, .events = POLLIN }
+    };
+    const char *tags[2] = { "out", "err" };
+    char buff[STREAM_CHUNK];
+
+    while(fds[0].fd >= 0 || fds[1].fd >= 0) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+
+        for(uint i = 0; i < 2; i++) {
+            if(fds[i].fd < 0 || fds[i].revents == 0) continue;
+
+            ssize_t n = read(fds[i].fd, buff, sizeof(buff));
+            if(n < 0 && errno == EINTR) continue;
+            if(n > 0) {
+                // A client gone away just stops getting output.
+                sendFrame(to, tags[i], buff, n);
+            } else {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+    }
+}
+
+// argv is set for run requests, text for eval ones.
+void runRequest (SymTab *globals, int argc, const char **argv,
+                 const char *text, size_t textLen, int in, int to) {
+    int pout[2], perr[2];
+    if(pipe(pout) != 0 || pipe(perr) != 0) {
+        dprintf(to, "error %s\n", strerror(errno));
+        return;
+    }
+
+    flushOutput();
+    pid_t pid = fork();
+    if(pid < 0) {
+        dprintf(to, "error %s\n", strerror(errno));
+        close(pout[0]); close(pout[1]);
+        close(perr[0]); close(perr[1]);
+        return;
+    }
+
+    if(pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        if(in > STDERR_FILENO) close(in);
+        if(to > STDERR_FILENO) close(to);
+
+        int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(pout[1], STDOUT_FILENO);
+        dup2(perr[1], STDERR_FILENO);
+        close(null);
+        close(pout[0]); close(pout[1]);
+        close(perr[0]); close(perr[1]);
+        outw.autoflush = false;
+
+        if(text != NULL) {
+            run_source((Source) { .name = "(request)", .buff = text,
+                                  .len = textLen, .fd = -1 }, globals);
+        } else {
+            symtabDefine(globals,
+                         cons((Symbol) {
+                                .word = constString("args"),
+                                .type = ARRAY,
+                                .value.array = mkStringArray(argc, argv)
+                              }, NULL));
+            run_source((Source) { .name = "(launch)", .buff = LAUNCH,
+                                  .len = sizeof(LAUNCH) - 1, .fd = -1 },
+                       globals);
+        }
+        exit(0);
+    }
+
+    close(pout[1]);
+    close(perr[1]);
+    relayOutput(pout[0], perr[0], to);
+
+    int status;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    int code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                 : 128 + WTERMSIG(status);
+    dprintf(to, "exit %d\n", code);
+}
+
+#define REQUEST_MAX 4096
+#define REQUEST_TEXT_MAX (16 << 20)
+
+// Serves one request from in, false at its end.
+bool serveRequest (SymTab *globals, FILE *in, int to) {
+    char line[REQUEST_MAX + 1];
+    if(fgets(line, sizeof(line), in) == NULL) return false;
+
+    size_t len = strlen(line);
+    if(len > 0 && line[len-1] == '\n') {
+        line[--len] = 0;
+    } else if(!feof(in)) {
+        dprintf(to, "error request longer than %d bytes\n", REQUEST_MAX);
+        return false;
+    }
+
+    bool more = true;
+    if(len == 0) {
+        // Blank lines between requests are skipped.
+    } else if(strncmp(line, "run ", 4) == 0) {
+        // Words are at least a byte and a space.
+        const char *argv[REQUEST_MAX / 2];
+        int argc = 0;
+        for(char *word = strtok(line + 4, " "); word != NULL;
+            word = strtok(NULL, " "))
+            argv[argc++] = word;
+
+        if(argc > 0) runRequest(globals, argc, argv, NULL, 0,
+                                fileno(in), to);
+        else dprintf(to, "error missing script path\n");
+    } else if(strncmp(line, "eval ", 5) == 0) {
+        // Text follows, so a length that can't be read ends the
+        // connection.
+        char *end;
+        errno = 0;
+        unsigned long long textLen = strtoull(line + 5, &end, 10);
+        if(line[5] < '0' || line[5] > '9' || *end != 0) {
+            dprintf(to, "error bad request\n");
+            return false;
+        }
+        if(errno == ERANGE || textLen > REQUEST_TEXT_MAX) {
+            dprintf(to, "error request too large\n");
+            return false;
+        }
+
+        char *text = malloc(textLen + 1);
+        if(text != NULL && fread(text, 1, textLen, in) == textLen)
+            runRequest(globals, 0, NULL, text, textLen, fileno(in), to);
+        else
+            more = false;
+        free(text);
+    } else {
+        dprintf(to, "error bad request\n");
+    }
+
+    return more;
+}
+
+int serve (const char *where) {
+    initWriters();
+    signal(SIGPIPE, SIG_IGN);
+
+    SymTab globals = mkSymTab(initial_global_symtab(0, NULL));
+    runBootstrap(&globals);
+
+    if(strcmp(where, "-") == 0) {
+        while(serveRequest(&globals, stdin, STDOUT_FILENO));
+        freeSymTab(&globals);
+        return 0;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(where) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", where);
+        return 1;
+    }
+    strcpy(addr.sun_path, where);
+
+    // Only a socket left by a former server is replaced.
+    struct stat details;
+    if(stat(where, &details) == 0 && S_ISSOCK(details.st_mode))
+        unlink(where);
+
+    // Bound without group and other permissions, so only our
+    // user can connect.
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0077);
+    bool bound = sock >= 0
+                 && bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+    umask(mask);
+    if(!bound || listen(sock, 64) != 0) {
+        fprintf(stderr, "%s: %s\n", where, strerror(errno));
+        return 1;
+    }
+
+    for(;;) {
+        while(waitpid(-1, NULL, WNOHANG) > 0);
+
+        int conn = accept(sock, NULL, NULL);
+        if(conn < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "%s: %s\n", where, strerror(errno));
+            return 1;
+        }
+
+        pid_t pid = fork();
+        if(pid == 0) {
+            close(sock);
+            FILE *in = fdopen(conn, "r");
+            while(serveRequest(&globals, in, conn));
+            _exit(0);
+        }
+        if(pid < 0)
+            fprintf(stderr, "%s: %s\n", where, strerror(errno));
+        close(conn);
+    }
+}
+
+int connectRun (const char *where, int argc, const char **argv) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, where, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0
+       || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "%s: %s\n", where, strerror(errno));
+        return 1;
+    }
+
+    // Server runs in its own directory.
+    char *path = realpath(argv[0], NULL);
+    if(path != NULL) argv[0] = path;
+
+    // Words of the request can't hold what separates them.
+    size_t reqLen = strlen("run");
+    for(int i = 0; i < argc; i++) {
+        if(strpbrk(argv[i], " \n") != NULL) {
+            fprintf(stderr, "%s: can't send argument with spaces "
+                            "or newlines: %s\n", where, argv[i]);
+            free(path);
+            close(sock);
+            return 1;
+        }
+        reqLen += 1 + strlen(argv[i]);
+    }
+    if(reqLen > REQUEST_MAX) {
+        fprintf(stderr, "%s: request longer than %d bytes\n",
+                where, REQUEST_MAX);
+        free(path);
+        close(sock);
+        return 1;
+    }
+
+    FILE *req = fdopen(dup(sock), "w");
+    fprintf(req, "run");
+    for(int i = 0; i < argc; i++)
+        fprintf(req, " %s", argv[i]);
+    fprintf(req, "\n");
+    fclose(req);
+    free(path);
+
+    FILE *in = fdopen(sock, "r");
+    char *line = NULL;
+    size_t cap = 0, len;
+    int code = 1;
+    char buff[STREAM_CHUNK];
+    while(getline(&line, &cap, in) > 0) {
+        FILE *to = NULL;
+        if(sscanf(line, "out %zu", &len) == 1) to = stdout;
+        else if(sscanf(line, "err %zu", &len) == 1) to = stderr;
+        else if(sscanf(line, "exit %d", &code) == 1) break;
+        else {
+            fprintf(stderr, "%s: %s", where, line);
+            break;
+        }
+
+        while(len > 0) {
+            size_t n = fread(buff, 1, (len < sizeof(buff)) ? len
+                                                          : sizeof(buff), in);
+            if(n == 0) break;
+            fwrite(buff, 1, n, to);
+            len -= n;
+        }
+    }
+
+    free(line);
+    fclose(in);
+    return code;
+}
+
+int main(int argc, const char **argv) {
+    // Also flushes children of server mode.
+    atexit(&profReport);
+    atexit(&flushOutput);
+
+    while(argc > 1) {
+        if(strcmp(argv[1], "--prof") == 0) {
+            prof = true;
+        } else if(strcmp(argv[1], "--trace") == 0) {
+            trace = true;
+        } else if(strcmp(argv[1], "--cache") == 0) {
+            cacheTokens = true;
+        } else if(strcmp(argv[1], "--image") == 0 && argc > 2) {
+            imageFile = argv[2];
+            argv[1] = argv[0];
+            argc--; argv++;
+        } else if(strcmp(argv[1], "--save-image") == 0 && argc > 2) {
+            return saveImage(argv[2]);
+        } else if(strcmp(argv[1], "--decode-trace") == 0) {
+            return traceDecode((argc > 2) ? argv[2] : TRACE_FILE);
+        } else if(strcmp(argv[1], "--serve") == 0) {
+            return serve((argc > 2) ? argv[2] : "-");
+        } else if(strcmp(argv[1], "--connect") == 0 && argc > 3) {
+            return connectRun(argv[2], argc - 3, argv + 3);
+        } else {
+            break;
+        }
+
+        argv[1] = argv[0];
+        argc--; argv++;
+    }
+
+    interpret(argc-1, argv+1);
 
     return 0;
 }
+#endif
@@ -0,0 +1,52 @@
+// Embedding API of lerl, built into liblerl.so by make lib.
+//
+// An interpreter runs the bootstrap when made and keeps its stack
+// between evaluations. Builtins registered by the host have the
+// same signature as lerl's own and use the stack through lerl_push_*
+// and lerl_pop_*. Script errors print a stack trace and make
+// lerl_eval_* return non-zero (or the code passed to exit), the
+// interpreter stays usable.
+//
+// An interpreter must be used by the thread which made it.
+#ifndef LERL_H
+#define LERL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LERL_API __attribute__((visibility("default")))
+
+typedef struct Lerl Lerl;
+typedef struct RunEnv RunEnv;
+typedef void (*LerlBuiltin) (RunEnv *env);
+
+// args are what the args word gives scripts. NULL if the bootstrap
+// fails.
+LERL_API Lerl *lerl_new (int argc, const char **argv);
+LERL_API void lerl_free (Lerl *lerl);
+
+// Return 0, or exit code of the failed script. The text is copied.
+LERL_API int lerl_eval_string (Lerl *lerl, const char *src, size_t len);
+LERL_API int lerl_eval_file (Lerl *lerl, const char *path);
+
+// Defines name as builtin, replacing former definition.
+LERL_API void lerl_register (Lerl *lerl, const char *name, LerlBuiltin fn);
+
+// The stack between evaluations; builtins get their env as argument.
+LERL_API RunEnv *lerl_env (Lerl *lerl);
+LERL_API size_t lerl_depth (RunEnv *env);
+
+LERL_API void lerl_push_int (RunEnv *env, int val);
+LERL_API void lerl_push_string (RunEnv *env, const char *data, size_t len);
+
+// Pop the top if it has the type (strings also take symbols),
+// otherwise return false and leave it. Strings are given as
+// malloc'd copies with a terminating 0, which the caller frees.
+LERL_API bool lerl_pop_int (RunEnv *env, int *val);
+LERL_API bool lerl_pop_string (RunEnv *env, char **data, size_t *len);
+LERL_API void lerl_drop (RunEnv *env);
+
+// For builtins: prints msg and a stack trace, fails the script.
+LERL_API void lerl_error (RunEnv *env, const char *msg);
+
+#endif
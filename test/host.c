@@ -0,0 +1,66 @@
+// Host program of the embedding API (lerl.h), run by make test.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lerl.h"
+
+void square (RunEnv *env) {
+    int val;
+    if(!lerl_pop_int(env, &val)) lerl_error(env, "square: int expected");
+    lerl_push_int(env, val * val);
+}
+
+int run (Lerl *lerl, const char *src) {
+    return lerl_eval_string(lerl, src, strlen(src));
+}
+
+int main () {
+    // Keeps our lines in order with the interpreter's errors.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    Lerl *lerl = lerl_new(0, NULL);
+    if(lerl == NULL) return 1;
+    lerl_register(lerl, "square", &square);
+    RunEnv *env = lerl_env(lerl);
+
+    // Definitions and the stack live across evaluations.
+    int val = 0;
+    run(lerl, "( 1 + square ) incsq fn");
+    printf("code %d\n", run(lerl, "6 incsq"));
+    bool ok = lerl_pop_int(env, &val);
+    printf("pop %d %d\n", ok, val);
+
+    // Errors fail the evaluation, not the interpreter.
+    int code = run(lerl, "nope square");
+    printf("code %d depth %zu\n", code, lerl_depth(env));
+    lerl_drop(env);
+    printf("code %d\n", run(lerl, "7 exit"));
+
+    // Bodies exit pmap with their code, the first element's wins.
+    printf("code %d\n", run(lerl, "( 1 2 3 4 5 6 7 8 ) "
+                                   "( n assign n 3 = ( 5 exit ) ? "
+                                   "n 6 = ( 6 exit ) ? n ) pmap"));
+
+    // Strings go both ways as copies.
+    char *str;
+    size_t len;
+    lerl_push_string(env, "abc", 3);
+    run(lerl, "builder 1 >>| << 4 incsq << >str");
+    ok = lerl_pop_string(env, &str, &len);
+    printf("pop %d %s %zu\n", ok, str, len);
+    free(str);
+
+    // Texts of many evaluations are freed, definitions stay.
+    char src[64];
+    for(int i = 0; i < 10000; i++) {
+        snprintf(src, sizeof(src), "( %d + ) 'add%d fn", i, i % 10);
+        run(lerl, src);
+    }
+    run(lerl, "1 add3");
+    ok = lerl_pop_int(env, &val);
+    printf("pop %d %d depth %zu\n", ok, val, lerl_depth(env));
+
+    printf("code %d\n", lerl_eval_file(lerl, "test/missing.lr"));
+    lerl_free(lerl);
+    return 0;
+}
@@ -0,0 +1,52 @@
+// Runs ex.lr on interpreters of two threads at once, built with
+// -fsanitize=thread by make test, which fails on any data race.
+// Interpreters share nothing, so each has its own pmap pool too.
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "lerl.h"
+
+#define THREADS 2
+
+// What the lerl command runs, so the output is test.exp.
+const char *launch = "args 0 @ load tokenize 1 >>| ;1 1 >>| ;1 !@";
+
+// pmap bodies sharing the lists of their caller.
+const char *shared =
+    "( 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 ) x assign\n"
+    "( x ( n assign ( n x ) inject n 2 * m assign m cons ) pmap\n"
+    "  ;1 ) 1 20 doCounting";
+
+void *runScript (void *arg) {
+    int *code = arg;
+    const char *argv[] = { "ex.lr" };
+    Lerl *lerl = lerl_new(1, argv);
+    if(lerl == NULL) {
+        *code = -1;
+        return NULL;
+    }
+
+    *code = lerl_eval_string(lerl, launch, strlen(launch));
+    if(*code == 0)
+        *code = lerl_eval_string(lerl, shared, strlen(shared));
+    lerl_free(lerl);
+    return NULL;
+}
+
+int main () {
+    pthread_t threads[THREADS];
+    int codes[THREADS];
+    for(int i = 0; i < THREADS; i++)
+        pthread_create(threads + i, NULL, runScript, codes + i);
+
+    int failed = 0;
+    for(int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        if(codes[i] != 0) {
+            fprintf(stderr, "thread %d: code %d\n", i, codes[i]);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}